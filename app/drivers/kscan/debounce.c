@@ -59,4 +59,116 @@ bool debounce_is_active(const struct debounce_state *state) {
 
 bool debounce_is_pressed(const struct debounce_state *state) { return state->pressed; }
 
-bool debounce_get_changed(const struct debounce_state *state) { return state->changed; }
\ No newline at end of file
+bool debounce_get_changed(const struct debounce_state *state) { return state->changed; }
+
+/** @returns a bitmask of the switches whose counter is not zero. */
+static uint32_t group_counter_nonzero(const struct debounce_group_state *state) {
+    uint32_t nonzero = 0;
+    for (int b = 0; b < DEBOUNCE_COUNTER_BITS; b++) {
+        nonzero |= state->counter[b];
+    }
+
+    return nonzero;
+}
+
+/** @returns a bitmask of the switches whose counter is at least value. */
+static uint32_t group_counter_at_least(const struct debounce_group_state *state,
+                                       const uint32_t value) {
+    if (value > DEBOUNCE_COUNTER_MAX) {
+        return 0;
+    }
+
+    // Compare from the most significant bit down. A counter is greater than the value once it has
+    // a 1 where the value has a 0 and all higher bits are equal.
+    uint32_t greater = 0;
+    uint32_t equal = UINT32_MAX;
+
+    for (int b = DEBOUNCE_COUNTER_BITS - 1; b >= 0; b--) {
+        const uint32_t bits = state->counter[b];
+
+        if (value & BIT(b)) {
+            equal &= bits;
+        } else {
+            greater |= equal & bits;
+            equal &= ~bits;
+        }
+    }
+
+    return greater | equal;
+}
+
+/** Adds value to the counters of the switches in mask, saturating at DEBOUNCE_COUNTER_MAX. */
+static void group_increment_counter(struct debounce_group_state *state, const uint32_t mask,
+                                    const uint32_t value) {
+    uint32_t carry = 0;
+
+    for (int b = 0; b < DEBOUNCE_COUNTER_BITS; b++) {
+        const uint32_t bits = state->counter[b];
+        const uint32_t addend = (value & BIT(b)) ? mask : 0;
+
+        state->counter[b] = bits ^ addend ^ carry;
+        carry = (bits & addend) | (carry & (bits ^ addend));
+    }
+
+    if (value > DEBOUNCE_COUNTER_MAX) {
+        carry = mask;
+    }
+
+    for (int b = 0; b < DEBOUNCE_COUNTER_BITS; b++) {
+        state->counter[b] |= carry;
+    }
+}
+
+/** Subtracts value from the counters of the switches in mask, saturating at 0. */
+static void group_decrement_counter(struct debounce_group_state *state, const uint32_t mask,
+                                    const uint32_t value) {
+    uint32_t borrow = 0;
+
+    for (int b = 0; b < DEBOUNCE_COUNTER_BITS; b++) {
+        const uint32_t bits = state->counter[b];
+        const uint32_t subtrahend = (value & BIT(b)) ? mask : 0;
+
+        state->counter[b] = bits ^ subtrahend ^ borrow;
+        borrow = (~bits & subtrahend) | (~(bits ^ subtrahend) & borrow);
+    }
+
+    if (value > DEBOUNCE_COUNTER_MAX) {
+        borrow = mask;
+    }
+
+    for (int b = 0; b < DEBOUNCE_COUNTER_BITS; b++) {
+        state->counter[b] &= ~borrow;
+    }
+}
+
+void debounce_group_update(struct debounce_group_state *state, const uint32_t active,
+                           const int elapsed_ms, const struct debounce_config *config) {
+    // Same integrator as debounce_update, applied to every switch of the group at once.
+    const uint32_t mismatched = active ^ state->pressed;
+    const uint32_t threshold_reached =
+        (state->pressed & group_counter_at_least(state, config->debounce_release_ms)) |
+        (~state->pressed & group_counter_at_least(state, config->debounce_press_ms));
+    const uint32_t flipped = mismatched & threshold_reached;
+
+    group_decrement_counter(state, ~mismatched, elapsed_ms);
+    group_increment_counter(state, mismatched & ~flipped, elapsed_ms);
+
+    for (int b = 0; b < DEBOUNCE_COUNTER_BITS; b++) {
+        state->counter[b] &= ~flipped;
+    }
+
+    state->pressed ^= flipped;
+    state->changed = flipped;
+}
+
+uint32_t debounce_group_get_active(const struct debounce_group_state *state) {
+    return state->pressed | group_counter_nonzero(state);
+}
+
+uint32_t debounce_group_get_pressed(const struct debounce_group_state *state) {
+    return state->pressed;
+}
+
+uint32_t debounce_group_get_changed(const struct debounce_group_state *state) {
+    return state->changed;
+}
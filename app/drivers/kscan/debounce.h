@@ -54,3 +54,43 @@ bool debounce_is_pressed(const struct debounce_state *state);
  * debounce_update.
  */
 bool debounce_get_changed(const struct debounce_state *state);
+
+/** Number of switches debounced together by debounce_group_update. */
+#define DEBOUNCE_GROUP_SIZE 32
+
+/**
+ * Debounce state for up to DEBOUNCE_GROUP_SIZE switches, one bit per switch. The counters are
+ * bit-sliced: bit n of counter[b] is bit b of the counter of switch n.
+ */
+struct debounce_group_state {
+    uint32_t pressed;
+    uint32_t changed;
+    uint32_t counter[DEBOUNCE_COUNTER_BITS];
+};
+
+/**
+ * Debounces a group of switches at once, with the same timing as debounce_update.
+ *
+ * @param state The state for the switches to debounce.
+ * @param active Bitmask of the switches that are currently pressed.
+ * @param elapsed_ms Time elapsed since the previous update in milliseconds.
+ * @param config Debounce settings.
+ */
+void debounce_group_update(struct debounce_group_state *state, const uint32_t active,
+                           const int elapsed_ms, const struct debounce_config *config);
+
+/**
+ * @returns a bitmask of the switches for which debounce_is_active would return true.
+ */
+uint32_t debounce_group_get_active(const struct debounce_group_state *state);
+
+/**
+ * @returns a bitmask of the switches latched as pressed.
+ */
+uint32_t debounce_group_get_pressed(const struct debounce_group_state *state);
+
+/**
+ * @returns a bitmask of the switches whose pressed state changed in the last call to
+ * debounce_group_update.
+ */
+uint32_t debounce_group_get_changed(const struct debounce_group_state *state);
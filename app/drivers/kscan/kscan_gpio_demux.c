@@ -11,6 +11,8 @@
 #include <drivers/gpio.h>
 #include <logging/log.h>
 
+#include <zmk/workqueue.h>
+
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 struct kscan_gpio_item_config {
@@ -93,7 +95,7 @@ struct kscan_gpio_item_config {
     static void kscan_gpio_timer_handler(struct k_timer *timer) {                                  \
         struct kscan_gpio_data_##n *data =                                                         \
             CONTAINER_OF(timer, struct kscan_gpio_data_##n, poll_timer);                           \
-        k_work_submit(&data->work.work);                                                           \
+        k_work_submit_to_queue(zmk_workqueue_input_work_q(), &data->work.work);                    \
     }                                                                                              \
                                                                                                    \
     /* Read the state of the input GPIOs */                                                        \
@@ -135,8 +137,9 @@ struct kscan_gpio_item_config {
             }                                                                                      \
         }                                                                                          \
         if (submit_follow_up_read) {                                                               \
-            CHECK_DEBOUNCE_CFG(n, ({ k_work_submit(&data->work); }),                               \
-                               ({ k_work_reschedule(&data->work, K_MSEC(5)); }))                   \
+            struct k_work_q *queue = zmk_workqueue_input_work_q();                                 \
+            CHECK_DEBOUNCE_CFG(n, ({ k_work_submit_to_queue(queue, &data->work); }),               \
+                               ({ k_work_reschedule_for_queue(queue, &data->work, K_MSEC(5)); }))  \
         }                                                                                          \
         return 0;                                                                                  \
     }                                                                                              \
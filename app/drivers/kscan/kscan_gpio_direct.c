@@ -5,6 +5,7 @@
  */
 
 #include "debounce.h"
+#include "poll_rate.h"
 
 #include <device.h>
 #include <devicetree.h>
@@ -14,6 +15,8 @@
 #include <logging/log.h>
 #include <sys/util.h>
 
+#include <zmk/workqueue.h>
+
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #define DT_DRV_COMPAT zmk_kscan_gpio_direct
@@ -55,6 +58,9 @@ struct kscan_direct_data {
 #if USE_INTERRUPTS
     /** Array of length config->inputs.len */
     struct kscan_direct_irq_callback *irqs;
+#endif
+#if USE_POLLING
+    struct poll_rate_state poll_rate;
 #endif
     /** Timestamp of the current or scheduled scan. */
     int64_t scan_time;
@@ -121,7 +127,7 @@ static void kscan_direct_irq_callback_handler(const struct device *port, struct
 
     data->scan_time = k_uptime_get();
 
-    k_work_reschedule(&data->work, K_NO_WAIT);
+    k_work_reschedule_for_queue(zmk_workqueue_input_work_q(), &data->work, K_NO_WAIT);
 }
 #endif
 
@@ -154,9 +160,15 @@ static void kscan_direct_read_continue(const struct device *dev) {
     const struct kscan_direct_config *config = dev->config;
     struct kscan_direct_data *data = dev->data;
 
+#if USE_POLLING
+    poll_rate_read_active(&data->poll_rate, config->debounce_scan_period_ms, data->scan_time,
+                          dev->name);
+#endif
+
     data->scan_time += config->debounce_scan_period_ms;
 
-    k_work_reschedule(&data->work, K_TIMEOUT_ABS_MS(data->scan_time));
+    k_work_reschedule_for_queue(zmk_workqueue_input_work_q(), &data->work,
+                                K_TIMEOUT_ABS_MS(data->scan_time));
 }
 
 static void kscan_direct_read_end(const struct device *dev) {
@@ -167,10 +179,12 @@ static void kscan_direct_read_end(const struct device *dev) {
     struct kscan_direct_data *data = dev->data;
     const struct kscan_direct_config *config = dev->config;
 
-    data->scan_time += config->poll_period_ms;
+    data->scan_time +=
+        poll_rate_read_idle(&data->poll_rate, config->poll_period_ms, data->scan_time, dev->name);
 
     // Return to polling slowly.
-    k_work_reschedule(&data->work, K_TIMEOUT_ABS_MS(data->scan_time));
+    k_work_reschedule_for_queue(zmk_workqueue_input_work_q(), &data->work,
+                                K_TIMEOUT_ABS_MS(data->scan_time));
 #endif
 }
 
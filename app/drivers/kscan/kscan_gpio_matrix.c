@@ -5,6 +5,7 @@
  */
 
 #include "debounce.h"
+#include "poll_rate.h"
 
 #include <device.h>
 #include <devicetree.h>
@@ -15,6 +16,9 @@
 #include <sys/__assert.h>
 #include <sys/util.h>
 
+#include <zmk/latency.h>
+#include <zmk/workqueue.h>
+
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #define DT_DRV_COMPAT zmk_kscan_gpio_matrix
@@ -25,8 +29,9 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #define INST_ROWS_LEN(n) DT_INST_PROP_LEN(n, row_gpios)
 #define INST_COLS_LEN(n) DT_INST_PROP_LEN(n, col_gpios)
-#define INST_MATRIX_LEN(n) (INST_ROWS_LEN(n) * INST_COLS_LEN(n))
 #define INST_INPUTS_LEN(n) COND_DIODE_DIR(n, (INST_COLS_LEN(n)), (INST_ROWS_LEN(n)))
+#define INST_OUTPUTS_LEN(n) COND_DIODE_DIR(n, (INST_ROWS_LEN(n)), (INST_COLS_LEN(n)))
+#define INST_INPUT_GROUPS_LEN(n) DIV_ROUND_UP(INST_INPUTS_LEN(n), DEBOUNCE_GROUP_SIZE)
 
 #if CONFIG_ZMK_KSCAN_DEBOUNCE_PRESS_MS >= 0
 #define INST_DEBOUNCE_PRESS_MS(n) CONFIG_ZMK_KSCAN_DEBOUNCE_PRESS_MS
@@ -64,6 +69,12 @@ struct kscan_matrix_irq_callback {
     struct gpio_callback callback;
 };
 
+/** A GPIO port with at least one input pin, and its value from the last read. */
+struct kscan_matrix_port {
+    const struct device *port;
+    gpio_port_value_t value;
+};
+
 struct kscan_matrix_data {
     const struct device *dev;
     kscan_callback_t callback;
@@ -71,14 +82,25 @@ struct kscan_matrix_data {
 #if USE_INTERRUPTS
     /** Array of length config->inputs.len */
     struct kscan_matrix_irq_callback *irqs;
+#endif
+    /**
+     * Ports of the input pins, so each output step reads every port once instead of every pin.
+     * Array of length config->inputs.len, of which the first ports_len entries are used.
+     */
+    struct kscan_matrix_port *ports;
+    size_t ports_len;
+    /** Array of length config->inputs.len: index into ports of each input's port. */
+    uint8_t *input_ports;
+#if USE_POLLING
+    struct poll_rate_state poll_rate;
 #endif
     /** Timestamp of the current or scheduled scan. */
     int64_t scan_time;
     /**
-     * Current state of the matrix as a flattened 2D array of length
-     * (config->rows.len * config->cols.len)
+     * Current state of the matrix, debounced DEBOUNCE_GROUP_SIZE inputs at a time, as a flattened
+     * 2D array of length (config->outputs.len * input_groups_len(config)).
      */
-    struct debounce_state *matrix_state;
+    struct debounce_group_state *matrix_state;
 };
 
 struct kscan_gpio_list {
@@ -102,23 +124,21 @@ struct kscan_matrix_config {
 };
 
 /**
- * Get the index into a matrix state array from a row and column.
+ * Get the number of debounce groups needed to hold all inputs.
  */
-static int state_index_rc(const struct kscan_matrix_config *config, const int row, const int col) {
-    __ASSERT(row < config->rows.len, "Invalid row %i", row);
-    __ASSERT(col < config->cols.len, "Invalid column %i", col);
-
-    return (col * config->rows.len) + row;
+static int input_groups_len(const struct kscan_matrix_config *config) {
+    return DIV_ROUND_UP(config->inputs.len, DEBOUNCE_GROUP_SIZE);
 }
 
 /**
- * Get the index into a matrix state array from input/output pin indices.
+ * Get the index into a matrix state array from output pin and input group indices.
  */
-static int state_index_io(const struct kscan_matrix_config *config, const int input_idx,
-                          const int output_idx) {
-    return (config->diode_direction == KSCAN_ROW2COL)
-               ? state_index_rc(config, output_idx, input_idx)
-               : state_index_rc(config, input_idx, output_idx);
+static int state_index_og(const struct kscan_matrix_config *config, const int output_idx,
+                          const int group_idx) {
+    __ASSERT(output_idx < config->outputs.len, "Invalid output %i", output_idx);
+    __ASSERT(group_idx < input_groups_len(config), "Invalid input group %i", group_idx);
+
+    return (output_idx * input_groups_len(config)) + group_idx;
 }
 
 static int kscan_matrix_set_all_outputs(const struct device *dev, const int value) {
@@ -193,7 +213,7 @@ static void kscan_matrix_irq_callback_handler(const struct device *port, struct
 
     data->scan_time = k_uptime_get();
 
-    k_work_reschedule(&data->work, K_NO_WAIT);
+    k_work_reschedule_for_queue(zmk_workqueue_input_work_q(), &data->work, K_NO_WAIT);
 }
 #endif
 
@@ -201,9 +221,15 @@ static void kscan_matrix_read_continue(const struct device *dev) {
     const struct kscan_matrix_config *config = dev->config;
     struct kscan_matrix_data *data = dev->data;
 
+#if USE_POLLING
+    poll_rate_read_active(&data->poll_rate, config->debounce_scan_period_ms, data->scan_time,
+                          dev->name);
+#endif
+
     data->scan_time += config->debounce_scan_period_ms;
 
-    k_work_reschedule(&data->work, K_TIMEOUT_ABS_MS(data->scan_time));
+    k_work_reschedule_for_queue(zmk_workqueue_input_work_q(), &data->work,
+                                K_TIMEOUT_ABS_MS(data->scan_time));
 }
 
 static void kscan_matrix_read_end(const struct device *dev) {
@@ -214,16 +240,35 @@ static void kscan_matrix_read_end(const struct device *dev) {
     struct kscan_matrix_data *data = dev->data;
     const struct kscan_matrix_config *config = dev->config;
 
-    data->scan_time += config->poll_period_ms;
+    data->scan_time +=
+        poll_rate_read_idle(&data->poll_rate, config->poll_period_ms, data->scan_time, dev->name);
 
     // Return to polling slowly.
-    k_work_reschedule(&data->work, K_TIMEOUT_ABS_MS(data->scan_time));
+    k_work_reschedule_for_queue(zmk_workqueue_input_work_q(), &data->work,
+                                K_TIMEOUT_ABS_MS(data->scan_time));
 #endif
 }
 
+static int kscan_matrix_read_ports(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+
+    for (int p = 0; p < data->ports_len; p++) {
+        struct kscan_matrix_port *port = &data->ports[p];
+
+        int err = gpio_port_get(port->port, &port->value);
+        if (err) {
+            LOG_ERR("Failed to read port %s: %i", port->port->name, err);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
 static int kscan_matrix_read(const struct device *dev) {
     struct kscan_matrix_data *data = dev->data;
     const struct kscan_matrix_config *config = dev->config;
+    const uint32_t scan_started_at = zmk_latency_timestamp();
 
     // Scan the matrix.
     for (int o = 0; o < config->outputs.len; o++) {
@@ -239,14 +284,28 @@ static int kscan_matrix_read(const struct device *dev) {
         k_busy_wait(CONFIG_ZMK_KSCAN_MATRIX_WAIT_BEFORE_INPUTS);
 #endif
 
-        for (int i = 0; i < config->inputs.len; i++) {
-            const struct gpio_dt_spec *in_gpio = &config->inputs.gpios[i];
+        err = kscan_matrix_read_ports(dev);
+        if (err) {
+            gpio_pin_set_dt(out_gpio, 0);
+            return err;
+        }
+
+        for (int g = 0; g < input_groups_len(config); g++) {
+            const int first_input = g * DEBOUNCE_GROUP_SIZE;
+            const int inputs_len = MIN(config->inputs.len - first_input, DEBOUNCE_GROUP_SIZE);
+            uint32_t active = 0;
 
-            const int index = state_index_io(config, i, o);
-            const bool active = gpio_pin_get_dt(in_gpio);
+            for (int i = 0; i < inputs_len; i++) {
+                const struct gpio_dt_spec *in_gpio = &config->inputs.gpios[first_input + i];
+                const gpio_port_value_t port_value =
+                    data->ports[data->input_ports[first_input + i]].value;
 
-            debounce_update(&data->matrix_state[index], active, config->debounce_scan_period_ms,
-                            &config->debounce_config);
+                active |= ((port_value >> in_gpio->pin) & 1) << i;
+            }
+
+            const int index = state_index_og(config, o, g);
+            debounce_group_update(&data->matrix_state[index], active,
+                                  config->debounce_scan_period_ms, &config->debounce_config);
         }
 
         err = gpio_pin_set_dt(out_gpio, 0);
@@ -260,22 +319,32 @@ static int kscan_matrix_read(const struct device *dev) {
 #endif
     }
 
+    zmk_latency_record(ZMK_LATENCY_STAGE_MATRIX_SCAN, zmk_latency_timestamp() - scan_started_at);
+
     // Process the new state.
     bool continue_scan = false;
 
-    for (int r = 0; r < config->rows.len; r++) {
-        for (int c = 0; c < config->cols.len; c++) {
-            const int index = state_index_rc(config, r, c);
-            struct debounce_state *state = &data->matrix_state[index];
-
-            if (debounce_get_changed(state)) {
-                const bool pressed = debounce_is_pressed(state);
+    for (int o = 0; o < config->outputs.len; o++) {
+        for (int g = 0; g < input_groups_len(config); g++) {
+            const int index = state_index_og(config, o, g);
+            struct debounce_group_state *state = &data->matrix_state[index];
+
+            // Only visit the switches that changed.
+            uint32_t changed = debounce_group_get_changed(state);
+            while (changed) {
+                const int bit = find_lsb_set(changed) - 1;
+                const int i = g * DEBOUNCE_GROUP_SIZE + bit;
+                const int r = (config->diode_direction == KSCAN_ROW2COL) ? o : i;
+                const int c = (config->diode_direction == KSCAN_ROW2COL) ? i : o;
+                const bool pressed = (debounce_group_get_pressed(state) & BIT(bit)) != 0;
 
                 LOG_DBG("Sending event at %i,%i state %s", r, c, pressed ? "on" : "off");
                 data->callback(dev, r, c, pressed);
+
+                changed &= ~BIT(bit);
             }
 
-            continue_scan = continue_scan || debounce_is_active(state);
+            continue_scan = continue_scan || debounce_group_get_active(state) != 0;
         }
     }
 
@@ -344,8 +413,20 @@ static int kscan_matrix_init_input_inst(const struct device *dev, const struct g
 
     LOG_DBG("Configured pin %u on %s for input", gpio->pin, gpio->port->name);
 
-#if USE_INTERRUPTS
     struct kscan_matrix_data *data = dev->data;
+
+    int port_index = 0;
+    while (port_index < data->ports_len && data->ports[port_index].port != gpio->port) {
+        port_index++;
+    }
+
+    if (port_index == data->ports_len) {
+        data->ports[data->ports_len++].port = gpio->port;
+    }
+
+    data->input_ports[index] = port_index;
+
+#if USE_INTERRUPTS
     struct kscan_matrix_irq_callback *irq = &data->irqs[index];
 
     irq->dev = dev;
@@ -438,13 +519,19 @@ static const struct kscan_driver_api kscan_matrix_api = {
     static const struct gpio_dt_spec kscan_matrix_cols_##n[] = {                                   \
         UTIL_LISTIFY(INST_COLS_LEN(n), KSCAN_GPIO_COL_CFG_INIT, n)};                               \
                                                                                                    \
-    static struct debounce_state kscan_matrix_state_##n[INST_MATRIX_LEN(n)];                       \
+    static struct debounce_group_state                                                             \
+        kscan_matrix_state_##n[INST_OUTPUTS_LEN(n) * INST_INPUT_GROUPS_LEN(n)];                    \
+                                                                                                   \
+    static struct kscan_matrix_port kscan_matrix_ports_##n[INST_INPUTS_LEN(n)];                    \
+    static uint8_t kscan_matrix_input_ports_##n[INST_INPUTS_LEN(n)];                               \
                                                                                                    \
     COND_INTERRUPTS(                                                                               \
         (static struct kscan_matrix_irq_callback kscan_matrix_irqs_##n[INST_INPUTS_LEN(n)];))      \
                                                                                                    \
     static struct kscan_matrix_data kscan_matrix_data_##n = {                                      \
         .matrix_state = kscan_matrix_state_##n,                                                    \
+        .ports = kscan_matrix_ports_##n,                                                           \
+        .input_ports = kscan_matrix_input_ports_##n,                                               \
         COND_INTERRUPTS((.irqs = kscan_matrix_irqs_##n, ))};                                       \
                                                                                                    \
     static struct kscan_matrix_config kscan_matrix_config_##n = {                                  \
@@ -14,6 +14,16 @@
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #include <dt-bindings/zmk/kscan_mock.h>
+#include <zmk/workqueue.h>
+
+#if IS_ENABLED(CONFIG_ARCH_POSIX)
+#include <posix_board_if.h>
+
+// Unlike exit(), posix_exit() runs the ON_EXIT native tasks that log the benchmark reports.
+#define KSCAN_MOCK_EXIT() posix_exit(0)
+#else
+#define KSCAN_MOCK_EXIT() exit(0)
+#endif
 
 struct kscan_mock_data {
     kscan_callback_t callback;
@@ -23,10 +33,168 @@ struct kscan_mock_data {
     const struct device *dev;
 };
 
+#if IS_ENABLED(CONFIG_ZMK_KSCAN_MOCK_TRACE)
+#include <stdio.h>
+#include <string.h>
+#include <soc.h>
+#include <cmdline.h>
+
+// A trace is a text file with one key event per line: "<timestamp ms> <row> <column> <pressed>".
+// Timestamps are relative to any fixed point and must not decrease. Lines starting with '#'
+// are ignored.
+struct kscan_mock_trace_record {
+    uint64_t timestamp;
+    uint32_t row;
+    uint32_t column;
+    bool pressed;
+};
+
+static char *trace_path = NULL;
+static double trace_speed = 1.0;
+
+static FILE *trace_file;
+static uint32_t trace_line;
+static uint32_t trace_events;
+static struct kscan_mock_trace_record trace_next;
+static uint64_t trace_last_timestamp;
+static bool trace_exit_after;
+static uint32_t trace_rows;
+static uint32_t trace_columns;
+static const struct device *trace_dev;
+static struct k_work_delayable trace_work;
+
+static void kscan_mock_trace_options(void) {
+    static struct args_struct_t options[] = {
+        {.option = "kscan-trace",
+         .name = "path",
+         .type = 's',
+         .dest = (void *)&trace_path,
+         .descript = "Replay key events from this kscan_mock trace file instead of the "
+                     "devicetree events. Use - to read the trace from stdin."},
+        {.option = "kscan-trace-speed",
+         .name = "factor",
+         .type = 'd',
+         .dest = (void *)&trace_speed,
+         .descript = "Replay the trace this many times faster than recorded. 0 replays every "
+                     "event without waiting. Defaults to 1."},
+        ARG_TABLE_ENDMARKER};
+
+    native_add_command_line_opts(options);
+}
+
+NATIVE_TASK(kscan_mock_trace_options, PRE_BOOT_1, 1);
+
+static bool kscan_mock_trace_read(struct kscan_mock_trace_record *record) {
+    char line[80];
+
+    while (fgets(line, sizeof(line), trace_file) != NULL) {
+        unsigned long long timestamp;
+        unsigned int row, column, pressed;
+
+        trace_line++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "%llu %u %u %u", &timestamp, &row, &column, &pressed) != 4) {
+            LOG_WRN("Skipping malformed trace line %u", trace_line);
+            continue;
+        }
+        if (row >= trace_rows || column >= trace_columns) {
+            LOG_WRN("Skipping trace line %u, row %u column %u is outside the matrix", trace_line,
+                    row, column);
+            continue;
+        }
+
+        record->timestamp = timestamp;
+        record->row = row;
+        record->column = column;
+        record->pressed = pressed != 0;
+        return true;
+    }
+
+    return false;
+}
+
+static uint32_t kscan_mock_trace_delay_ms(uint64_t timestamp) {
+    if (trace_speed <= 0 || timestamp <= trace_last_timestamp) {
+        return 0;
+    }
+    return (uint32_t)((timestamp - trace_last_timestamp) / trace_speed);
+}
+
+static void kscan_mock_trace_finish(void) {
+    LOG_INF("Trace replay finished after %u events", trace_events);
+    if (trace_file != stdin) {
+        fclose(trace_file);
+    }
+    trace_file = NULL;
+
+    if (trace_exit_after) {
+        KSCAN_MOCK_EXIT();
+    }
+}
+
+static void kscan_mock_trace_work_handler(struct k_work *work) {
+    struct kscan_mock_data *data = trace_dev->data;
+
+    // Deliver every event that is due now, so events recorded together (or replayed without
+    // waiting) reach the kscan callback back to back, as they would from a real scan.
+    do {
+        trace_last_timestamp = trace_next.timestamp;
+        LOG_DBG("trace row %d column %d state %d", trace_next.row, trace_next.column,
+                trace_next.pressed);
+        data->callback(trace_dev, trace_next.row, trace_next.column, trace_next.pressed);
+        trace_events++;
+
+        if (!kscan_mock_trace_read(&trace_next)) {
+            kscan_mock_trace_finish();
+            return;
+        }
+    } while (kscan_mock_trace_delay_ms(trace_next.timestamp) == 0);
+
+    k_work_schedule_for_queue(zmk_workqueue_input_work_q(), &trace_work,
+                              K_MSEC(kscan_mock_trace_delay_ms(trace_next.timestamp)));
+}
+
+static int kscan_mock_trace_start(const struct device *dev, uint32_t rows, uint32_t columns,
+                                  bool exit_after) {
+    if (strcmp(trace_path, "-") == 0) {
+        trace_file = stdin;
+    } else {
+        trace_file = fopen(trace_path, "r");
+        if (trace_file == NULL) {
+            LOG_ERR("Unable to open trace file %s", trace_path);
+            return -ENOENT;
+        }
+    }
+
+    trace_dev = dev;
+    trace_rows = rows;
+    trace_columns = columns;
+    trace_exit_after = exit_after;
+    k_work_init_delayable(&trace_work, kscan_mock_trace_work_handler);
+
+    if (!kscan_mock_trace_read(&trace_next)) {
+        kscan_mock_trace_finish();
+        return 0;
+    }
+    trace_last_timestamp = trace_next.timestamp;
+
+    LOG_INF("Replaying trace %s at %u%% speed", trace_path, (uint32_t)(trace_speed * 100));
+    k_work_schedule_for_queue(zmk_workqueue_input_work_q(), &trace_work, K_NO_WAIT);
+    return 0;
+}
+#endif /* IS_ENABLED(CONFIG_ZMK_KSCAN_MOCK_TRACE) */
+
 static int kscan_mock_disable_callback(const struct device *dev) {
     struct kscan_mock_data *data = dev->data;
 
     k_work_cancel_delayable(&data->work);
+#if IS_ENABLED(CONFIG_ZMK_KSCAN_MOCK_TRACE)
+    if (trace_dev == dev) {
+        k_work_cancel_delayable(&trace_work);
+    }
+#endif
     return 0;
 }
 
@@ -43,6 +211,17 @@ static int kscan_mock_configure(const struct device *dev, kscan_callback_t callb
     return 0;
 }
 
+#if IS_ENABLED(CONFIG_ZMK_KSCAN_MOCK_TRACE)
+// only the first instance replays the trace
+#define KSCAN_MOCK_TRACE_REQUESTED(n) ((n) == 0 && trace_path != NULL)
+#define KSCAN_MOCK_TRACE_START(n, dev)                                                             \
+    kscan_mock_trace_start(dev, DT_INST_PROP_OR(n, rows, UINT8_MAX),                               \
+                           DT_INST_PROP_OR(n, columns, UINT8_MAX), DT_INST_PROP(n, exit_after))
+#else
+#define KSCAN_MOCK_TRACE_REQUESTED(n) false
+#define KSCAN_MOCK_TRACE_START(n, dev) 0
+#endif
+
 #define MOCK_INST_INIT(n)                                                                          \
     struct kscan_mock_config_##n {                                                                 \
         uint32_t events[DT_INST_PROP_LEN(n, events)];                                              \
@@ -54,10 +233,11 @@ static int kscan_mock_configure(const struct device *dev, kscan_callback_t callb
         if (data->event_index < DT_INST_PROP_LEN(n, events)) {                                     \
             uint32_t ev = cfg->events[data->event_index];                                          \
             LOG_DBG("delaying next keypress: %d", ZMK_MOCK_MSEC(ev));                              \
-            k_work_schedule(&data->work, K_MSEC(ZMK_MOCK_MSEC(ev)));                               \
+            k_work_schedule_for_queue(zmk_workqueue_input_work_q(), &data->work,                   \
+                                      K_MSEC(ZMK_MOCK_MSEC(ev)));                                  \
         } else if (cfg->exit_after) {                                                              \
             LOG_DBG("Exiting");                                                                    \
-            exit(0);                                                                               \
+            KSCAN_MOCK_EXIT();                                                                     \
         }                                                                                          \
     }                                                                                              \
     static void kscan_mock_work_handler_##n(struct k_work *work) {                                 \
@@ -77,6 +257,9 @@ static int kscan_mock_configure(const struct device *dev, kscan_callback_t callb
         return 0;                                                                                  \
     }                                                                                              \
     static int kscan_mock_enable_callback_##n(const struct device *dev) {                          \
+        if (KSCAN_MOCK_TRACE_REQUESTED(n)) {                                                       \
+            return KSCAN_MOCK_TRACE_START(n, dev);                                                 \
+        }                                                                                          \
         kscan_mock_schedule_next_event_##n(dev);                                                   \
         return 0;                                                                                  \
     }                                                                                              \
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "poll_rate.h"
+
+#include <kernel.h>
+#include <logging/log.h>
+#include <sys/util.h>
+
+LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+static void log_stats(struct poll_rate_state *state, const int64_t now, const char *name) {
+#if IS_ENABLED(CONFIG_ZMK_KSCAN_POLLING_STATS)
+    const int64_t elapsed_ms = now - state->stats_since;
+    if (elapsed_ms < CONFIG_ZMK_KSCAN_POLLING_STATS_INTERVAL_S * MSEC_PER_SEC) {
+        return;
+    }
+
+    const uint32_t wakeups_per_s = (uint32_t)(state->wakeups * MSEC_PER_SEC / elapsed_ms);
+    const uint32_t delay_avg =
+        state->detections ? state->detection_delay_total / state->detections : 0;
+
+    LOG_INF("%s: %u wakeups/s, %u key detections, detection delay avg %u ms, max %u ms", name,
+            wakeups_per_s, state->detections, delay_avg, state->detection_delay_max);
+
+    state->stats_since = now;
+    state->wakeups = 0;
+    state->detections = 0;
+    state->detection_delay_total = 0;
+    state->detection_delay_max = 0;
+#endif
+}
+
+void poll_rate_read_active(struct poll_rate_state *state, const int32_t period_ms,
+                           const int64_t now, const char *name) {
+    state->wakeups++;
+
+    if (!state->active) {
+        // The key could have been pressed any time since the previous read.
+        state->detections++;
+        state->detection_delay_total += state->period_ms;
+        state->detection_delay_max = MAX(state->detection_delay_max, state->period_ms);
+    }
+
+    state->active = true;
+    state->last_active = now;
+    state->period_ms = period_ms;
+
+    log_stats(state, now, name);
+}
+
+int32_t poll_rate_read_idle(struct poll_rate_state *state, const int32_t period_ms,
+                            const int64_t now, const char *name) {
+    state->wakeups++;
+
+    if (state->active) {
+        state->active = false;
+        state->last_active = now;
+    }
+
+    int32_t next_period_ms = period_ms;
+
+#if IS_ENABLED(CONFIG_ZMK_KSCAN_ADAPTIVE_POLLING)
+    // Double the period for every CONFIG_ZMK_KSCAN_ADAPTIVE_POLLING_DECAY_MS spent idle, so reads
+    // stay frequent during short pauses in typing and slow down when the keyboard is left alone.
+    const int64_t idle_ms = now - state->last_active;
+    const int32_t max_period_ms = MAX(period_ms, CONFIG_ZMK_KSCAN_ADAPTIVE_POLLING_MAX_PERIOD_MS);
+
+    for (int64_t decayed_ms = CONFIG_ZMK_KSCAN_ADAPTIVE_POLLING_DECAY_MS;
+         decayed_ms <= idle_ms && next_period_ms < max_period_ms;
+         decayed_ms += CONFIG_ZMK_KSCAN_ADAPTIVE_POLLING_DECAY_MS) {
+        next_period_ms = MIN(next_period_ms * 2, max_period_ms);
+    }
+#endif
+
+    state->period_ms = next_period_ms;
+
+    log_stats(state, now, name);
+
+    return next_period_ms;
+}
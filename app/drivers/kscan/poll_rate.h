@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct poll_rate_state {
+    /** Time between the previous read and the current one. */
+    int32_t period_ms;
+    /** Timestamp of the last read which found a key active. */
+    int64_t last_active;
+    /** Whether the last read found a key active. */
+    bool active;
+
+    /** Statistics since stats_since, logged with CONFIG_ZMK_KSCAN_POLLING_STATS. */
+    int64_t stats_since;
+    uint32_t wakeups;
+    uint32_t detections;
+    uint32_t detection_delay_total;
+    uint32_t detection_delay_max;
+};
+
+/**
+ * Records a read of a polling kscan driver which found a key active.
+ *
+ * @param state The polling state of the driver.
+ * @param period_ms Time until the next read.
+ * @param now Timestamp of this read.
+ * @param name Name of the driver, for logging.
+ */
+void poll_rate_read_active(struct poll_rate_state *state, const int32_t period_ms,
+                           const int64_t now, const char *name);
+
+/**
+ * Records a read of a polling kscan driver which found every key released.
+ *
+ * @param state The polling state of the driver.
+ * @param period_ms Time between reads right after the last key was released.
+ * @param now Timestamp of this read.
+ * @param name Name of the driver, for logging.
+ * @returns the time until the next read. With CONFIG_ZMK_KSCAN_ADAPTIVE_POLLING, this grows
+ * from period_ms up to CONFIG_ZMK_KSCAN_ADAPTIVE_POLLING_MAX_PERIOD_MS as the keyboard stays idle.
+ */
+int32_t poll_rate_read_idle(struct poll_rate_state *state, const int32_t period_ms,
+                            const int64_t now, const char *name);
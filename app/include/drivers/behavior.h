@@ -45,6 +45,22 @@ __subsystem struct behavior_driver_api {
  * @endcond
  */
 
+/**
+ * @brief Get the behavior device of a keymap binding
+ * @param binding Pointer to the details so of the binding
+ *
+ * @retval The device cached in the binding, looked up by label if it was not resolved yet.
+ * @retval NULL if no behavior device with that label exists.
+ */
+static inline const struct device *
+behavior_binding_get_device(const struct zmk_behavior_binding *binding) {
+    if (binding->behavior != NULL) {
+        return binding->behavior;
+    }
+
+    return device_get_binding(binding->behavior_dev);
+}
+
 /**
  * @brief Handle the keymap binding which needs to be converted from relative "toggle" to absolute
  * "turn on"
@@ -59,7 +75,12 @@ __syscall int behavior_keymap_binding_convert_central_state_dependent_params(
 
 static inline int z_impl_behavior_keymap_binding_convert_central_state_dependent_params(
     struct zmk_behavior_binding *binding, struct zmk_behavior_binding_event event) {
-    const struct device *dev = device_get_binding(binding->behavior_dev);
+    const struct device *dev = behavior_binding_get_device(binding);
+
+    if (dev == NULL) {
+        return -EINVAL;
+    }
+
     const struct behavior_driver_api *api = (const struct behavior_driver_api *)dev->api;
 
     if (api->binding_convert_central_state_dependent_params == NULL) {
@@ -105,7 +126,7 @@ __syscall int behavior_keymap_binding_pressed(struct zmk_behavior_binding *bindi
 
 static inline int z_impl_behavior_keymap_binding_pressed(struct zmk_behavior_binding *binding,
                                                          struct zmk_behavior_binding_event event) {
-    const struct device *dev = device_get_binding(binding->behavior_dev);
+    const struct device *dev = behavior_binding_get_device(binding);
 
     if (dev == NULL) {
         return -EINVAL;
@@ -133,7 +154,7 @@ __syscall int behavior_keymap_binding_released(struct zmk_behavior_binding *bind
 
 static inline int z_impl_behavior_keymap_binding_released(struct zmk_behavior_binding *binding,
                                                           struct zmk_behavior_binding_event event) {
-    const struct device *dev = device_get_binding(binding->behavior_dev);
+    const struct device *dev = behavior_binding_get_device(binding);
 
     if (dev == NULL) {
         return -EINVAL;
@@ -165,7 +186,7 @@ __syscall int behavior_sensor_keymap_binding_triggered(struct zmk_behavior_bindi
 static inline int
 z_impl_behavior_sensor_keymap_binding_triggered(struct zmk_behavior_binding *binding,
                                                 const struct device *sensor, int64_t timestamp) {
-    const struct device *dev = device_get_binding(binding->behavior_dev);
+    const struct device *dev = behavior_binding_get_device(binding);
 
     if (dev == NULL) {
         return -EINVAL;
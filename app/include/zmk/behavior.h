@@ -9,8 +9,12 @@
 #define ZMK_BEHAVIOR_OPAQUE 0
 #define ZMK_BEHAVIOR_TRANSPARENT 1
 
+struct device;
+
 struct zmk_behavior_binding {
     char *behavior_dev;
+    // Resolved device for behavior_dev, if already looked up. May be NULL.
+    const struct device *behavior;
     uint32_t param1;
     uint32_t param2;
 };
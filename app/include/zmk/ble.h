@@ -29,6 +29,9 @@ int zmk_ble_active_profile_index();
 bt_addr_le_t *zmk_ble_active_profile_addr();
 bool zmk_ble_active_profile_is_open();
 bool zmk_ble_active_profile_is_connected();
+// Returns a new reference to the connection to the active profile's host, or NULL if there is
+// none. The caller must release it with bt_conn_unref().
+struct bt_conn *zmk_ble_active_profile_conn();
 char *zmk_ble_active_profile_name();
 
 int zmk_ble_unpair_all();
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <bluetooth/addr.h>
+#include <bluetooth/conn.h>
+
+// Tracks a reference to the connection to the active profile's host, so sending a report doesn't
+// need to search the connection pool.
+
+// Starts tracking conn if it is connected to active_addr. Returns true if it is now tracked.
+bool zmk_ble_active_conn_connected(struct bt_conn *conn, const bt_addr_le_t *active_addr);
+// Stops tracking conn. Returns true if it was tracked.
+bool zmk_ble_active_conn_disconnected(struct bt_conn *conn);
+// Looks up the connection to active_addr after a profile switch or an address change.
+void zmk_ble_active_conn_update(const bt_addr_le_t *active_addr);
+// Returns a new reference to the tracked connection, or NULL if there is none.
+struct bt_conn *zmk_ble_active_conn_get();
+bool zmk_ble_active_conn_is_set();
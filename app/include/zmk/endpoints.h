@@ -6,6 +6,9 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <sys/util.h>
+#include <zephyr/types.h>
 #include <zmk/endpoints_types.h>
 
 int zmk_endpoints_select(enum zmk_endpoint endpoint);
@@ -13,3 +16,26 @@ int zmk_endpoints_toggle();
 enum zmk_endpoint zmk_endpoints_selected();
 
 int zmk_endpoints_send_report(uint16_t usage_page);
+
+struct zmk_endpoints_report_counts {
+    // reports passed on to the current endpoint
+    uint32_t sent;
+    // reports that were identical to the last one sent to the current endpoint
+    uint32_t suppressed;
+};
+
+struct zmk_endpoints_report_counts zmk_endpoints_get_report_counts();
+
+#if IS_ENABLED(CONFIG_ZMK_HID_BATCH_REPORTS)
+// Reports sent between begin and end are combined and sent at the end.
+void zmk_endpoints_batch_begin();
+void zmk_endpoints_batch_end();
+// Must be called before the HID state of usage changes. Sends the pending reports first if
+// usage already changed in the batch, or if ordered is set because the change must not be
+// combined with others.
+void zmk_endpoints_batch_add(uint32_t usage, bool ordered);
+#else
+static inline void zmk_endpoints_batch_begin() {}
+static inline void zmk_endpoints_batch_end() {}
+static inline void zmk_endpoints_batch_add(uint32_t usage, bool ordered) {}
+#endif
@@ -10,13 +10,29 @@
 #include <kernel.h>
 #include <zephyr/types.h>
 
+struct zmk_event_subscription;
+
+struct zmk_event_pool {
+    struct k_mem_slab *slab;
+    atomic_t heap_fallbacks;
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL_STATS)
+    // Most blocks of the slab ever in use at once
+    atomic_t max_used;
+#endif
+};
+
 struct zmk_event_type {
     const char *name;
+    struct zmk_event_pool *pool;
+    // Subscriptions for this type are grouped into one contiguous slice at link time
+    const struct zmk_event_subscription *subscriptions_start;
+    const struct zmk_event_subscription *subscriptions_end;
 };
 
 typedef struct {
     const struct zmk_event_type *event;
     uint8_t last_listener_index;
+    bool from_pool;
 } zmk_event_t;
 
 #define ZMK_EV_EVENT_BUBBLE 0
@@ -26,11 +42,28 @@ typedef struct {
 typedef int (*zmk_listener_callback_t)(const zmk_event_t *eh);
 struct zmk_listener {
     zmk_listener_callback_t callback;
+#if IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS)
+    const char *name;
+#endif
+};
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS)
+struct zmk_listener_stats {
+    uint32_t calls;
+    uint32_t bubbled;
+    uint32_t handled;
+    uint32_t captured;
+    uint64_t total_cycles;
+    uint32_t max_cycles;
 };
+#endif
 
 struct zmk_event_subscription {
     const struct zmk_event_type *event_type;
     const struct zmk_listener *listener;
+#if IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS)
+    struct zmk_listener_stats *stats;
+#endif
 };
 
 #define ZMK_EVENT_DECLARE(event_type)                                                              \
@@ -42,15 +75,35 @@ struct zmk_event_subscription {
     struct event_type *as_##event_type(const zmk_event_t *eh);                                     \
     extern const struct zmk_event_type zmk_event_##event_type;
 
-#define ZMK_EVENT_IMPL(event_type)                                                                 \
-    const struct zmk_event_type zmk_event_##event_type = {.name = STRINGIFY(event_type)};          \
+#define ZMK_EVENT_SUBSCRIPTION_SECTION(event_type, part)                                           \
+    __attribute__((__section__(".event_subscription." STRINGIFY(event_type) "." part)))
+
+#define ZMK_EVENT_IMPL(event_type) ZMK_EVENT_IMPL_POOL(event_type, CONFIG_ZMK_EVENT_POOL_SIZE)
+
+#define ZMK_EVENT_IMPL_POOL(event_type, pool_size)                                                 \
+    K_MEM_SLAB_DEFINE(zmk_event_slab_##event_type, sizeof(struct event_type##_event), pool_size,   \
+                      __alignof__(struct event_type##_event));                                     \
+    struct zmk_event_pool zmk_event_pool_##event_type = {.slab = &zmk_event_slab_##event_type};   \
+    const Z_DECL_ALIGN(struct zmk_event_subscription)                                              \
+        zmk_event_subs_start_##event_type[0] __used                                                \
+        ZMK_EVENT_SUBSCRIPTION_SECTION(event_type, "0");                                           \
+    const Z_DECL_ALIGN(struct zmk_event_subscription)                                              \
+        zmk_event_subs_end_##event_type[0] __used                                                  \
+        ZMK_EVENT_SUBSCRIPTION_SECTION(event_type, "2");                                           \
+    const struct zmk_event_type zmk_event_##event_type = {                                         \
+        .name = STRINGIFY(event_type),                                                             \
+        .pool = &zmk_event_pool_##event_type,                                                      \
+        .subscriptions_start = zmk_event_subs_start_##event_type,                                  \
+        .subscriptions_end = zmk_event_subs_end_##event_type,                                      \
+    };                                                                                             \
     const struct zmk_event_type *zmk_event_ref_##event_type __used                                 \
         __attribute__((__section__(".event_type"))) = &zmk_event_##event_type;                     \
     struct event_type##_event *new_##event_type(struct event_type data) {                          \
-        struct event_type##_event *ev =                                                            \
-            (struct event_type##_event *)k_malloc(sizeof(struct event_type##_event));              \
-        ev->header.event = &zmk_event_##event_type;                                                \
-        ev->data = data;                                                                           \
+        struct event_type##_event *ev = (struct event_type##_event *)zmk_event_manager_alloc(      \
+            &zmk_event_##event_type, sizeof(struct event_type##_event));                           \
+        if (ev != NULL) {                                                                          \
+            ev->data = data;                                                                       \
+        }                                                                                          \
         return ev;                                                                                 \
     };                                                                                             \
     struct event_type *as_##event_type(const zmk_event_t *eh) {                                    \
@@ -58,14 +111,29 @@ struct zmk_event_subscription {
                                                       : NULL;                                      \
     };
 
+#if IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS)
+#define ZMK_LISTENER(mod, cb)                                                                      \
+    const struct zmk_listener zmk_listener_##mod = {.callback = cb, .name = STRINGIFY(mod)};
+
+#define ZMK_SUBSCRIPTION_STATS_DEFINE(mod, ev_type)                                                \
+    static struct zmk_listener_stats _CONCAT(_CONCAT(zmk_event_sub_stats_, mod), ev_type);
+#define ZMK_SUBSCRIPTION_STATS_INIT(mod, ev_type)                                                  \
+    .stats = &_CONCAT(_CONCAT(zmk_event_sub_stats_, mod), ev_type),
+#else
 #define ZMK_LISTENER(mod, cb) const struct zmk_listener zmk_listener_##mod = {.callback = cb};
 
+#define ZMK_SUBSCRIPTION_STATS_DEFINE(mod, ev_type)
+#define ZMK_SUBSCRIPTION_STATS_INIT(mod, ev_type)
+#endif
+
 #define ZMK_SUBSCRIPTION(mod, ev_type)                                                             \
+    ZMK_SUBSCRIPTION_STATS_DEFINE(mod, ev_type)                                                    \
     const Z_DECL_ALIGN(struct zmk_event_subscription)                                              \
         _CONCAT(_CONCAT(zmk_event_sub_, mod), ev_type) __used                                      \
-        __attribute__((__section__(".event_subscription"))) = {                                    \
+        ZMK_EVENT_SUBSCRIPTION_SECTION(ev_type, "1") = {                                           \
             .event_type = &zmk_event_##ev_type,                                                    \
             .listener = &zmk_listener_##mod,                                                       \
+            ZMK_SUBSCRIPTION_STATS_INIT(mod, ev_type)                                              \
     };
 
 #define ZMK_EVENT_RAISE(ev) zmk_event_manager_raise((zmk_event_t *)ev);
@@ -78,9 +146,21 @@ struct zmk_event_subscription {
 
 #define ZMK_EVENT_RELEASE(ev) zmk_event_manager_release((zmk_event_t *)ev);
 
-#define ZMK_EVENT_FREE(ev) k_free((void *)ev);
+#define ZMK_EVENT_FREE(ev) zmk_event_manager_free((zmk_event_t *)ev);
+
+zmk_event_t *zmk_event_manager_alloc(const struct zmk_event_type *event_type, size_t size);
+void zmk_event_manager_free(zmk_event_t *event);
 
 int zmk_event_manager_raise(zmk_event_t *event);
 int zmk_event_manager_raise_after(zmk_event_t *event, const struct zmk_listener *listener);
 int zmk_event_manager_raise_at(zmk_event_t *event, const struct zmk_listener *listener);
-int zmk_event_manager_release(zmk_event_t *event);
\ No newline at end of file
+int zmk_event_manager_release(zmk_event_t *event);
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL_STATS)
+void zmk_event_manager_log_pool_stats(void);
+#endif
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS)
+void zmk_event_manager_log_listener_stats(void);
+void zmk_event_manager_reset_listener_stats(void);
+#endif
\ No newline at end of file
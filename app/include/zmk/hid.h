@@ -154,3 +154,9 @@ bool zmk_hid_is_pressed(uint32_t usage);
 
 struct zmk_hid_keyboard_report *zmk_hid_get_keyboard_report();
 struct zmk_hid_consumer_report *zmk_hid_get_consumer_report();
+
+// Whether the queued report `next` can replace `last` without the host missing anything that
+// happened after `prev`. The reports are `len` bytes long, with modifier bits in the first
+// `mods_len` bytes.
+bool zmk_hid_report_can_coalesce(const uint8_t *prev, const uint8_t *last, const uint8_t *next,
+                                 size_t len, size_t mods_len);
@@ -6,9 +6,68 @@
 
 #pragma once
 
+#include <devicetree.h>
+#include <sys/util.h>
 #include <zmk/events/position_state_changed.h>
 
-typedef uint32_t zmk_keymap_layers_state_t;
+#if DT_HAS_COMPAT_STATUS_OKAY(zmk_keymap)
+#define ZMK_KEYMAP_LAYER_CHILD_LEN(node) 1 +
+#define ZMK_KEYMAP_LAYERS_LEN                                                                      \
+    (DT_FOREACH_CHILD(DT_INST(0, zmk_keymap), ZMK_KEYMAP_LAYER_CHILD_LEN) 0)
+#else
+#define ZMK_KEYMAP_LAYERS_LEN 1
+#endif
+
+#define ZMK_KEYMAP_LAYER_STATE_WORDS DIV_ROUND_UP(ZMK_KEYMAP_LAYERS_LEN, 32)
+
+// One bit per layer, sized to the number of layers in the keymap
+typedef struct {
+    uint32_t words[ZMK_KEYMAP_LAYER_STATE_WORDS];
+} zmk_keymap_layers_state_t;
+
+static inline bool zmk_keymap_layers_state_test(const zmk_keymap_layers_state_t *state,
+                                                uint8_t layer) {
+    return (state->words[layer / 32] & BIT(layer % 32)) != 0;
+}
+
+static inline void zmk_keymap_layers_state_write(zmk_keymap_layers_state_t *state, uint8_t layer,
+                                                 bool value) {
+    WRITE_BIT(state->words[layer / 32], layer % 32, value);
+}
+
+// Returns true if every layer set in mask is also set in state
+static inline bool zmk_keymap_layers_state_contains(const zmk_keymap_layers_state_t *state,
+                                                    const zmk_keymap_layers_state_t *mask) {
+    for (int i = 0; i < ZMK_KEYMAP_LAYER_STATE_WORDS; i++) {
+        if ((state->words[i] & mask->words[i]) != mask->words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the highest layer set in state that is lower than limit, or -1 if there is none
+static inline int zmk_keymap_layers_state_highest_below(const zmk_keymap_layers_state_t *state,
+                                                        int limit) {
+    if (limit <= 0) {
+        return -1;
+    }
+
+    int word = (limit - 1) / 32;
+    uint32_t bits = state->words[word] & (UINT32_MAX >> (31 - (limit - 1) % 32));
+    while (bits == 0) {
+        if (--word < 0) {
+            return -1;
+        }
+        bits = state->words[word];
+    }
+
+    return word * 32 + find_msb_set(bits) - 1;
+}
+
+static inline int zmk_keymap_layers_state_highest(const zmk_keymap_layers_state_t *state) {
+    return zmk_keymap_layers_state_highest_below(state, ZMK_KEYMAP_LAYER_STATE_WORDS * 32);
+}
 
 uint8_t zmk_keymap_layer_default();
 zmk_keymap_layers_state_t zmk_keymap_layer_state();
@@ -6,4 +6,9 @@
 
 #pragma once
 
+#include <zephyr/types.h>
+
 int zmk_kscan_init(char *name);
+
+// Number of key events the kscan driver reported that did not fit in the event queue.
+uint32_t zmk_kscan_dropped_events(void);
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <zephyr/types.h>
+#include <sys/util.h>
+
+enum zmk_latency_stage {
+    // time between the kscan driver reporting a key and the key being processed
+    ZMK_LATENCY_STAGE_KSCAN,
+    ZMK_LATENCY_STAGE_POSITION,
+    ZMK_LATENCY_STAGE_KEYCODE,
+    ZMK_LATENCY_STAGE_REPORT,
+    // time the GPIO matrix driver takes to scan every output once
+    ZMK_LATENCY_STAGE_MATRIX_SCAN,
+    // time a work item waits on the input work queue after its timer expired, in kernel uptime
+    ZMK_LATENCY_STAGE_DISPATCH,
+    // time zmk_keymap_highest_layer_active() takes for ZMK_LATENCY_LAYER_QUERIES calls
+    ZMK_LATENCY_STAGE_HIGHEST_LAYER,
+    ZMK_LATENCY_STAGE_COUNT,
+};
+
+#define ZMK_LATENCY_LAYER_QUERIES 10000
+
+#if IS_ENABLED(CONFIG_ZMK_LATENCY_BENCHMARK)
+
+uint32_t zmk_latency_timestamp(void);
+
+// Starts timing a key event that was reported by the kscan driver at kscan_timestamp.
+void zmk_latency_key_begin(uint32_t kscan_timestamp);
+// Stops timing the current key event and adds its processing time to the totals.
+void zmk_latency_key_end(void);
+// Ends the batch of key events from one scan. Stamps after this are not caused by a scanned key.
+void zmk_latency_keys_done(void);
+// Records the time since the key event being processed was reported by the kscan driver, or
+// since the first key event of the batch once its keys have been processed. Stamps raised from
+// timers, like hold-tap decisions or macro steps, have no such key event and are skipped.
+void zmk_latency_stamp(enum zmk_latency_stage stage);
+// Records a duration measured with zmk_latency_timestamp().
+void zmk_latency_record(enum zmk_latency_stage stage, uint32_t duration);
+
+void zmk_latency_log_report(void);
+
+#else
+
+static inline uint32_t zmk_latency_timestamp(void) { return 0; }
+static inline void zmk_latency_key_begin(uint32_t kscan_timestamp) {}
+static inline void zmk_latency_key_end(void) {}
+static inline void zmk_latency_keys_done(void) {}
+static inline void zmk_latency_stamp(enum zmk_latency_stage stage) {}
+static inline void zmk_latency_record(enum zmk_latency_stage stage, uint32_t duration) {}
+
+#endif /* IS_ENABLED(CONFIG_ZMK_LATENCY_BENCHMARK) */
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <device.h>
+
+// Behaviors are sent between the halves as their index in a table built from the children of the
+// /behaviors and /macros devicetree nodes. The halves compare hashes of their tables before any
+// index is sent, as a table that differs, e.g. from a shield overlay adding a behavior, would run
+// the wrong behavior.
+
+// Returns the index of the behavior device in the table, or -ENODEV if it is not in it.
+int zmk_split_behavior_index(const struct device *behavior);
+
+// Returns the behavior device at index, or NULL if there is none.
+const struct device *zmk_split_behavior_get(uint8_t index);
+
+// Returns the label of the behavior at index, or NULL if index is out of range.
+const char *zmk_split_behavior_label(uint8_t index);
+
+// Returns a hash of the labels in the table, in order.
+uint32_t zmk_split_behaviors_hash();
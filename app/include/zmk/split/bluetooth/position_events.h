@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <zephyr/types.h>
+
+#include <zmk/split/clock_offset.h>
+
+// The central's view of a peripheral's position events characteristic.
+struct zmk_split_position_events_receiver {
+    // position_state matches the peripheral up to the notification numbered next_seq
+    bool synced;
+    uint8_t next_seq;
+    struct zmk_split_clock_offset clock;
+};
+
+typedef void (*zmk_split_position_changed_t)(uint8_t position, bool pressed, int64_t timestamp,
+                                             void *user_data);
+
+void zmk_split_position_events_reset(struct zmk_split_position_events_receiver *receiver);
+
+// Starts accepting notifications from seq on, once position_state was read from the sync.
+void zmk_split_position_events_synced(struct zmk_split_position_events_receiver *receiver,
+                                      uint8_t seq);
+
+// Applies a notification received at central time now to position_state, and calls changed with
+// the central time of every position that changed. Returns -EINVAL for a malformed notification,
+// and -EAGAIN if the receiver isn't synced or notifications were lost, in which case the
+// characteristic has to be read again.
+int zmk_split_position_events_receive(struct zmk_split_position_events_receiver *receiver,
+                                      uint8_t *position_state, const uint8_t *data,
+                                      uint16_t length, int64_t now,
+                                      zmk_split_position_changed_t changed, void *user_data);
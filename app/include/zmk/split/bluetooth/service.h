@@ -6,19 +6,54 @@
 
 #pragma once
 
-#define ZMK_SPLIT_RUN_BEHAVIOR_DEV_LEN 9
+#include <sys/util.h>
 
-struct zmk_split_run_behavior_data {
+#define ZMK_SPLIT_POSITION_STATE_LEN 16
+
+// The most position events that fit in one notification at the minimum ATT MTU of 23.
+#define ZMK_SPLIT_POSITION_EVENTS_MAX 5
+#define ZMK_SPLIT_POSITION_EVENT_PRESSED BIT(7)
+#define ZMK_SPLIT_POSITION_EVENT_POSITION_MASK (ZMK_SPLIT_POSITION_EVENT_PRESSED - 1)
+
+#define ZMK_SPLIT_RUN_BEHAVIOR_PRESSED BIT(7)
+#define ZMK_SPLIT_RUN_BEHAVIOR_POSITION_MASK (ZMK_SPLIT_RUN_BEHAVIOR_PRESSED - 1)
+
+// Written without response, several back to back in one write when they fit in the ATT MTU. Only
+// sent once the central read the little endian zmk_split_behaviors_hash() of the peripheral and
+// found it equal to its own.
+struct zmk_split_run_behavior_payload {
+    // index of the behavior, see zmk/split/behaviors.h
+    uint8_t behavior;
+    // key position, ORed with ZMK_SPLIT_RUN_BEHAVIOR_PRESSED for presses
     uint8_t position;
-    uint8_t state;
     uint32_t param1;
     uint32_t param2;
 } __packed;
 
-struct zmk_split_run_behavior_payload {
-    struct zmk_split_run_behavior_data data;
-    char behavior_dev[ZMK_SPLIT_RUN_BEHAVIOR_DEV_LEN];
+struct zmk_split_position_event {
+    // key position, ORed with ZMK_SPLIT_POSITION_EVENT_PRESSED for presses
+    uint8_t position;
+    // little endian milliseconds from the key changing to the notification being sent, saturated
+    uint16_t age;
+} __packed;
+
+// Notified with only the used events, the count follows from the length.
+struct zmk_split_position_events {
+    // Incremented for every notification. A gap means events were lost, and the central reads
+    // the characteristic to resync.
+    uint8_t seq;
+    // little endian peripheral uptime in milliseconds when the notification was sent, truncated to
+    // 32 bits. The central estimates the offset to its own clock from it, to time the events.
+    uint32_t sent_at;
+    struct zmk_split_position_event events[ZMK_SPLIT_POSITION_EVENTS_MAX];
+} __packed;
+
+// Read from the position events characteristic. Notifications continue with seq and only carry
+// changes made after position_state.
+struct zmk_split_position_events_sync {
+    uint8_t seq;
+    uint8_t position_state[ZMK_SPLIT_POSITION_STATE_LEN];
 } __packed;
 
-int zmk_split_bt_position_pressed(uint8_t position);
-int zmk_split_bt_position_released(uint8_t position);
\ No newline at end of file
+int zmk_split_bt_position_pressed(uint8_t position, int64_t timestamp);
+int zmk_split_bt_position_released(uint8_t position, int64_t timestamp);
\ No newline at end of file
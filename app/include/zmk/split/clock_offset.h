@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <zephyr/types.h>
+
+struct zmk_split_clock_offset_window {
+    // smallest central minus peripheral time seen in the window, in milliseconds
+    int64_t offset;
+    // central time the smallest offset was seen at
+    int64_t at;
+    uint16_t samples;
+};
+
+// Maps a peripheral's uptime to the central's. The transport only ever delays a notification, so
+// the smallest difference between receiving and sending one is the closest to the true offset.
+// Minima are kept per window, and the drift between them is tracked so the estimate stays accurate
+// across idle periods without notifications.
+struct zmk_split_clock_offset {
+    bool valid;
+    // last peripheral time seen, extended to 64 bits
+    int64_t peripheral_time;
+    int64_t window_start;
+    struct zmk_split_clock_offset_window current;
+    struct zmk_split_clock_offset_window previous;
+    // decaying sums of the offset change and time between window minima
+    int64_t drift_offset_us;
+    int64_t drift_span_ms;
+    int32_t drift_ppm;
+};
+
+void zmk_split_clock_offset_reset(struct zmk_split_clock_offset *clock);
+
+// Adds a sample from a notification that was sent at peripheral_time and received at central_time.
+void zmk_split_clock_offset_update(struct zmk_split_clock_offset *clock, uint32_t peripheral_time,
+                                   int64_t central_time);
+
+// Returns the central time for a peripheral time close to the last sample.
+int64_t zmk_split_clock_offset_to_central(const struct zmk_split_clock_offset *clock,
+                                          uint32_t peripheral_time);
@@ -6,4 +6,9 @@
 
 #pragma once
 
-int zmk_usb_hid_send_report(const uint8_t *report, size_t len);
\ No newline at end of file
+#include <zephyr/types.h>
+
+int zmk_usb_hid_send_report(const uint8_t *report, size_t len);
+
+// Number of reports that found the send queue full.
+uint32_t zmk_usb_hid_queue_overflows();
\ No newline at end of file
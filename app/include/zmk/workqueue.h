@@ -0,0 +1,11 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+// Work queue that processes input, from the kscan drivers through the keymap and behaviors to
+// sending HID reports. Work that is not on that path belongs on the system work queue.
+struct k_work_q *zmk_workqueue_input_work_q();
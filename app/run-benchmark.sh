@@ -0,0 +1,36 @@
+#!/bin/sh
+
+# Copyright (c) 2022 The ZMK Contributors
+# SPDX-License-Identifier: MIT
+
+if [ -z "$1" ]; then
+	echo "Usage: ./run-benchmark.sh <path to benchmark>"
+	exit 1
+fi
+
+path="$1"
+if [ $path = "all" ]; then
+	path="benchmarks"
+fi
+
+benchmarks=$(find $path -name native_posix_64.keymap -exec dirname \{\} \;)
+num_cases=$(echo "$benchmarks" | wc -l)
+if [ $num_cases -gt 1 ] || [ "$benchmarks" != "$path" ]; then
+	# run one at a time, so the benchmarks do not compete for the CPU
+	echo "$benchmarks" | xargs -L 1 ./run-benchmark.sh
+	exit $?
+fi
+
+benchmark="$path"
+echo "Running $benchmark:"
+
+west build -d build/$benchmark -b native_posix_64 -- -DZMK_CONFIG="$(pwd)/$benchmark" > /dev/null 2>&1
+if [ $? -gt 0 ]; then
+	echo "FAILED: $benchmark did not build"
+	exit 1
+fi
+
+# benchmarks that don't end on their own pass e.g. -stop_at in native_posix_64.args
+args=$(cat $benchmark/native_posix_64.args 2>/dev/null)
+
+./build/$benchmark/zephyr/zmk.exe $args | sed -e "s/.*> //" | tee build/$benchmark/benchmark_full.log | sed -n -e "s/.*zmk: latency /latency /p"
@@ -0,0 +1,41 @@
+# Copyright (c) 2022 The ZMK Contributors
+# SPDX-License-Identifier: MIT
+"""Benchmark runner for ZMK."""
+
+import os
+import subprocess
+
+from west.commands import WestCommand
+from west import log  # use this for user output
+
+
+class Benchmark(WestCommand):
+    def __init__(self):
+        super().__init__(
+            name="benchmark",
+            help="run ZMK benchmarks",
+            description="Run the ZMK input latency benchmarks.",
+        )
+
+    def do_add_parser(self, parser_adder):
+        parser = parser_adder.add_parser(
+            self.name,
+            help=self.help,
+            description=self.description,
+        )
+
+        parser.add_argument(
+            "benchmark_path",
+            default="all",
+            help='The path to the benchmark. Defaults to "all".',
+            nargs="?",
+        )
+        return parser
+
+    def do_run(self, args, unknown_args):
+        # the run-benchmark script assumes the app directory is the current dir.
+        os.chdir(f"{self.topdir}/app")
+        completed_process = subprocess.run(
+            [f"{self.topdir}/app/run-benchmark.sh", args.benchmark_path]
+        )
+        exit(completed_process.returncode)
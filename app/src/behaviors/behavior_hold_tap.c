@@ -19,13 +19,14 @@
 #include <zmk/events/keycode_state_changed.h>
 #include <zmk/behavior.h>
 #include <zmk/keymap.h>
+#include <zmk/workqueue.h>
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
 
 #define ZMK_BHV_HOLD_TAP_MAX_HELD 10
-#define ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS 40
+#define ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS CONFIG_ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS
 
 // increase if you have keyboard with more keys.
 #define ZMK_BHV_HOLD_TAP_POSITION_NOT_USED 9999
@@ -87,7 +88,17 @@ struct active_hold_tap {
 struct active_hold_tap *undecided_hold_tap = NULL;
 struct active_hold_tap active_hold_taps[ZMK_BHV_HOLD_TAP_MAX_HELD] = {};
 // We capture most position_state_changed events and some modifiers_state_changed events.
+// The captured events are kept in a ring buffer, indexed by ever increasing counters.
+// Events in [capture_head, capture_tail) were captured by the undecided hold-tap.
+// Events in [capture_in_use_from, capture_head) are being released by release_captured_events.
 const zmk_event_t *captured_events[ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS] = {};
+uint32_t capture_head = 0;
+uint32_t capture_tail = 0;
+uint32_t capture_in_use_from = 0;
+int capture_release_depth = 0;
+uint32_t capture_overflows = 0;
+// number of key down events in [capture_head, capture_tail) for each key position
+uint8_t captured_keydowns[ZMK_KEYMAP_LEN] = {};
 
 // Keep track of which key was tapped most recently for the standard, if it is a hold-tap
 // a position, will be given, if not it will just be INT32_MIN
@@ -119,32 +130,37 @@ static bool is_quick_tap(struct active_hold_tap *hold_tap) {
 }
 
 static int capture_event(const zmk_event_t *event) {
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS; i++) {
-        if (captured_events[i] == NULL) {
-            captured_events[i] = event;
-            return 0;
-        }
+    if (capture_tail - capture_in_use_from >= ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS) {
+        capture_overflows++;
+        LOG_WRN("Unable to capture event, already %d captured (%d overflows). Increase "
+                "CONFIG_ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS",
+                ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS, capture_overflows);
+        return -ENOMEM;
     }
-    return -ENOMEM;
-}
+    captured_events[capture_tail % ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS] = event;
+    capture_tail++;
 
-static struct zmk_position_state_changed *find_captured_keydown_event(uint32_t position) {
-    struct zmk_position_state_changed *last_match = NULL;
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS; i++) {
-        const zmk_event_t *eh = captured_events[i];
-        if (eh == NULL) {
-            return last_match;
-        }
-        struct zmk_position_state_changed *position_event = as_zmk_position_state_changed(eh);
-        if (position_event == NULL) {
-            continue;
-        }
+    struct zmk_position_state_changed *position_event = as_zmk_position_state_changed(event);
+    if (position_event != NULL && position_event->state &&
+        position_event->position < ZMK_KEYMAP_LEN) {
+        captured_keydowns[position_event->position]++;
+    }
+    return 0;
+}
 
-        if (position_event->position == position && position_event->state) {
-            last_match = position_event;
+static bool is_keydown_captured(uint32_t position) {
+    if (position < ZMK_KEYMAP_LEN) {
+        return captured_keydowns[position] > 0;
+    }
+    for (uint32_t i = capture_head; i != capture_tail; i++) {
+        struct zmk_position_state_changed *position_event = as_zmk_position_state_changed(
+            captured_events[i % ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS]);
+        if (position_event != NULL && position_event->position == position &&
+            position_event->state) {
+            return true;
         }
     }
-    return last_match;
+    return false;
 }
 
 const struct zmk_listener zmk_listener_behavior_hold_tap;
@@ -154,37 +170,39 @@ static void release_captured_events() {
         return;
     }
 
-    // We use a trick to prevent copying the captured_events array.
-    //
-    // Events for different mod-tap instances are separated by a NULL pointer.
-    //
-    // The first event popped will never be catched by the next active hold-tap
-    // because to start capturing a mod-tap-key-down event must first completely
-    // go through the events queue.
+    // The events captured so far are handed over to this release. Events released here may
+    // start a new undecided hold-tap, which captures the events released after it into a new
+    // segment from capture_head. If that hold-tap is decided while we are still releasing,
+    // the nested call releases only its own segment.
     //
     // Example of this release process;
-    // [mt2_down, k1_down, k1_up, mt2_up, null, ...]
+    // [mt2_down, k1_down, k1_up, mt2_up]
     //  ^
     // mt2_down position event isn't captured because no hold-tap is active.
     // mt2_down behavior event is handled, now we have an undecided hold-tap
-    // [null, k1_down, k1_up, mt2_up, null, ...]
-    //        ^
-    // k1_down  is captured by the mt2 mod-tap
-    // !note that searches for find_captured_keydown_event by the mt2 behavior will stop at the
-    // first null encountered [mt1_down, null, k1_up, mt2_up, null, ...]
-    //                  ^
+    // [mt2_down, k1_down, k1_up, mt2_up] [ ]
+    //            ^
+    // k1_down is captured by the mt2 mod-tap into the new segment
+    // [mt2_down, k1_down, k1_up, mt2_up] [k1_down]
+    //                     ^
     // k1_up event is captured by the new hold-tap:
-    // [k1_down, k1_up, null, mt2_up, null, ...]
-    //                        ^
+    // [mt2_down, k1_down, k1_up, mt2_up] [k1_down, k1_up]
+    //                            ^
     // mt2_up event is not captured but causes release of mt2 behavior
-    // [k1_down, k1_up, null, null, null, ...]
     // now mt2 will start releasing it's own captured positions.
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS; i++) {
-        const zmk_event_t *captured_event = captured_events[i];
-        if (captured_event == NULL) {
-            return;
+    uint32_t release_from = capture_head;
+    uint32_t release_to = capture_tail;
+    capture_head = capture_tail;
+    memset(captured_keydowns, 0, sizeof(captured_keydowns));
+    capture_release_depth++;
+
+    for (uint32_t i = release_from; i != release_to; i++) {
+        const zmk_event_t *captured_event =
+            captured_events[i % ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS];
+        if (capture_release_depth == 1) {
+            // only the outermost release frees slots, nested releases are always newer.
+            capture_in_use_from = i + 1;
         }
-        captured_events[i] = NULL;
         if (undecided_hold_tap != NULL) {
             k_msleep(10);
         }
@@ -200,6 +218,10 @@ static void release_captured_events() {
         }
         ZMK_EVENT_RAISE_AT(captured_event, behavior_hold_tap);
     }
+
+    if (--capture_release_depth == 0) {
+        capture_in_use_from = capture_head;
+    }
 }
 
 static struct active_hold_tap *find_hold_tap(uint32_t position) {
@@ -507,7 +529,7 @@ static void update_hold_status_for_retro_tap(uint32_t ignore_position) {
 
 static int on_hold_tap_binding_pressed(struct zmk_behavior_binding *binding,
                                        struct zmk_behavior_binding_event event) {
-    const struct device *dev = device_get_binding(binding->behavior_dev);
+    const struct device *dev = behavior_binding_get_device(binding);
     const struct behavior_hold_tap_config *cfg = dev->config;
 
     if (undecided_hold_tap != NULL) {
@@ -534,7 +556,8 @@ static int on_hold_tap_binding_pressed(struct zmk_behavior_binding *binding,
     // if this behavior was queued we have to adjust the timer to only
     // wait for the remaining time.
     int32_t tapping_term_ms_left = (hold_tap->timestamp + cfg->tapping_term_ms) - k_uptime_get();
-    k_work_schedule(&hold_tap->work, K_MSEC(tapping_term_ms_left));
+    k_work_schedule_for_queue(zmk_workqueue_input_work_q(), &hold_tap->work,
+                              K_MSEC(tapping_term_ms_left));
 
     return ZMK_BEHAVIOR_OPAQUE;
 }
@@ -616,7 +639,7 @@ static int position_state_changed_listener(const zmk_event_t *eh) {
         return ZMK_EV_EVENT_BUBBLE;
     }
 
-    if (!ev->state && find_captured_keydown_event(ev->position) == NULL) {
+    if (!ev->state && !is_keydown_captured(ev->position)) {
         // no keydown event has been captured, let it bubble.
         // we'll catch modifiers later in modifier_state_changed_listener
         LOG_DBG("%d bubbling %d %s event", undecided_hold_tap->position, ev->position,
@@ -626,7 +649,9 @@ static int position_state_changed_listener(const zmk_event_t *eh) {
 
     LOG_DBG("%d capturing %d %s event", undecided_hold_tap->position, ev->position,
             ev->state ? "down" : "up");
-    capture_event(eh);
+    if (capture_event(eh) < 0) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
     decide_hold_tap(undecided_hold_tap, ev->state ? HT_OTHER_KEY_DOWN : HT_OTHER_KEY_UP);
     return ZMK_EV_EVENT_CAPTURED;
 }
@@ -653,7 +678,9 @@ static int keycode_state_changed_listener(const zmk_event_t *eh) {
     // if a undecided_hold_tap is active.
     LOG_DBG("%d capturing 0x%02X %s event", undecided_hold_tap->position, ev->keycode,
             ev->state ? "down" : "up");
-    capture_event(eh);
+    if (capture_event(eh) < 0) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
     return ZMK_EV_EVENT_CAPTURED;
 }
 
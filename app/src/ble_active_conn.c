@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <kernel.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+
+#include <zmk/ble/active_conn.h>
+
+static struct bt_conn *active_conn;
+static struct k_spinlock active_conn_lock;
+
+static void set_active_conn(struct bt_conn *conn) {
+    k_spinlock_key_t key = k_spin_lock(&active_conn_lock);
+    struct bt_conn *old_conn = active_conn;
+    active_conn = conn == NULL ? NULL : bt_conn_ref(conn);
+    k_spin_unlock(&active_conn_lock, key);
+
+    if (old_conn != NULL) {
+        bt_conn_unref(old_conn);
+    }
+}
+
+bool zmk_ble_active_conn_connected(struct bt_conn *conn, const bt_addr_le_t *active_addr) {
+    if (bt_addr_le_cmp(bt_conn_get_dst(conn), active_addr) != 0) {
+        return false;
+    }
+
+    set_active_conn(conn);
+    return true;
+}
+
+bool zmk_ble_active_conn_disconnected(struct bt_conn *conn) {
+    k_spinlock_key_t key = k_spin_lock(&active_conn_lock);
+    bool tracked = active_conn == conn;
+    if (tracked) {
+        active_conn = NULL;
+    }
+    k_spin_unlock(&active_conn_lock, key);
+
+    if (tracked) {
+        bt_conn_unref(conn);
+    }
+
+    return tracked;
+}
+
+void zmk_ble_active_conn_update(const bt_addr_le_t *active_addr) {
+    struct bt_conn *conn = NULL;
+    if (bt_addr_le_cmp(active_addr, BT_ADDR_LE_ANY)) {
+        conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, active_addr);
+    }
+
+    set_active_conn(conn);
+
+    if (conn != NULL) {
+        bt_conn_unref(conn);
+    }
+}
+
+struct bt_conn *zmk_ble_active_conn_get() {
+    k_spinlock_key_t key = k_spin_lock(&active_conn_lock);
+    struct bt_conn *conn = active_conn == NULL ? NULL : bt_conn_ref(active_conn);
+    k_spin_unlock(&active_conn_lock, key);
+
+    return conn;
+}
+
+bool zmk_ble_active_conn_is_set() {
+    k_spinlock_key_t key = k_spin_lock(&active_conn_lock);
+    bool set = active_conn != NULL;
+    k_spin_unlock(&active_conn_lock, key);
+
+    return set;
+}
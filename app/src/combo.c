@@ -18,6 +18,7 @@
 #include <zmk/hid.h>
 #include <zmk/matrix.h>
 #include <zmk/keymap.h>
+#include <zmk/workqueue.h>
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
@@ -46,22 +47,31 @@ struct active_combo {
     const zmk_event_t *key_positions_pressed[CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO];
 };
 
-struct combo_candidate {
-    struct combo_cfg *combo;
-    // the time after which this behavior should be removed from candidates.
-    // by keeping track of when the candidate should be cleared there is no
-    // possibility of accidental releases.
-    int64_t timeout_at;
-};
+#define COMBO_ONE(n) +1
+#define COMBOS_LEN (0 DT_INST_FOREACH_CHILD(0, COMBO_ONE))
+#define COMBO_SET_WORDS DIV_ROUND_UP(COMBOS_LEN, 32)
+
+// all combos, sorted shortest-first, then by virtual-key-position.
+// a combo's index in this array is its id in the combo sets below, so the lowest
+// set bit of a candidate set is always the preferred candidate.
+struct combo_cfg *combos[COMBOS_LEN];
+int combos_len = 0;
 
-// set of keys pressed
+// set of keys pressed, always contiguous from 0
 const zmk_event_t *pressed_keys[CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO] = {NULL};
+int pressed_keys_count = 0;
 // the set of candidate combos based on the currently pressed_keys
-struct combo_candidate candidates[CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY];
+uint32_t candidates[COMBO_SET_WORDS];
+// the time the first candidate key was pressed. a candidate is removed from the
+// candidates after its timeout_ms. by keeping track of when the candidate should
+// be cleared there is no possibility of accidental releases.
+int64_t candidates_pressed_at;
 // the last candidate that was completely pressed
 struct combo_cfg *fully_pressed_combo = NULL;
-// a lookup dict that maps a key position to all combos on that position
-struct combo_cfg *combo_lookup[ZMK_KEYMAP_LEN][CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY] = {NULL};
+// a lookup dict that maps a key position to the set of combos on that position
+uint32_t combo_lookup[ZMK_KEYMAP_LEN][COMBO_SET_WORDS];
+// the set of combos that may be triggered on each layer
+uint32_t layer_combos[ZMK_KEYMAP_LAYERS_LEN][COMBO_SET_WORDS];
 // combos that have been activated and still have (some) keys pressed
 // this array is always contiguous from 0.
 struct active_combo active_combos[CONFIG_ZMK_COMBO_MAX_PRESSED_COMBOS] = {NULL};
@@ -70,8 +80,43 @@ int active_combo_count = 0;
 struct k_work_delayable timeout_task;
 int64_t timeout_task_timeout_at;
 
-// Store the combo key pointer in the combos array, one pointer for each key position
-// The combos are sorted shortest-first, then by virtual-key-position.
+static inline void combo_set_add(uint32_t *set, int id) { set[id / 32] |= BIT(id % 32); }
+
+static inline void combo_set_remove(uint32_t *set, int id) { set[id / 32] &= ~BIT(id % 32); }
+
+static int combo_set_count(const uint32_t *set) {
+    int count = 0;
+    for (int i = 0; i < COMBO_SET_WORDS; i++) {
+        count += __builtin_popcount(set[i]);
+    }
+    return count;
+}
+
+// returns the lowest id in the set that is greater than `after`, or -1.
+static int combo_set_next(const uint32_t *set, int after) {
+    int id = after + 1;
+    for (int i = id / 32; i < COMBO_SET_WORDS; i++) {
+        uint32_t word = set[i];
+        if (i == id / 32) {
+            word &= ~(BIT(id % 32) - 1);
+        }
+        if (word != 0) {
+            return i * 32 + find_lsb_set(word) - 1;
+        }
+    }
+    return -1;
+}
+
+#define FOR_EACH_CANDIDATE(id)                                                                     \
+    for (int id = combo_set_next(candidates, -1); id >= 0; id = combo_set_next(candidates, id))
+
+static bool combo_sorts_before(struct combo_cfg *a, struct combo_cfg *b) {
+    return a->key_position_len < b->key_position_len ||
+           (a->key_position_len == b->key_position_len &&
+            a->virtual_key_position < b->virtual_key_position);
+}
+
+// Store the combo in the sorted combos array
 static int initialize_combo(struct combo_cfg *new_combo) {
     for (int i = 0; i < new_combo->key_position_len; i++) {
         int32_t position = new_combo->key_positions[i];
@@ -79,107 +124,69 @@ static int initialize_combo(struct combo_cfg *new_combo) {
             LOG_ERR("Unable to initialize combo, key position %d does not exist", position);
             return -EINVAL;
         }
+    }
 
-        struct combo_cfg *insert_combo = new_combo;
-        bool set = false;
-        for (int j = 0; j < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; j++) {
-            struct combo_cfg *combo_at_j = combo_lookup[position][j];
-            if (combo_at_j == NULL) {
-                combo_lookup[position][j] = insert_combo;
-                set = true;
-                break;
-            }
-            if (combo_at_j->key_position_len < insert_combo->key_position_len ||
-                (combo_at_j->key_position_len == insert_combo->key_position_len &&
-                 combo_at_j->virtual_key_position < insert_combo->virtual_key_position)) {
-                continue;
-            }
-            // put insert_combo in this spot, move all other combos up.
-            combo_lookup[position][j] = insert_combo;
-            insert_combo = combo_at_j;
-        }
-        if (!set) {
-            LOG_ERR("Too many combos for key position %d, CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY %d.",
-                    position, CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY);
-            return -ENOMEM;
-        }
+    int insert_at = combos_len++;
+    while (insert_at > 0 && combo_sorts_before(new_combo, combos[insert_at - 1])) {
+        combos[insert_at] = combos[insert_at - 1];
+        insert_at--;
     }
+    combos[insert_at] = new_combo;
     return 0;
 }
 
-static bool combo_active_on_layer(struct combo_cfg *combo, uint8_t layer) {
-    if (combo->layers[0] == -1) {
-        // -1 in the first layer position is global layer scope
-        return true;
-    }
-    for (int j = 0; j < combo->layers_len; j++) {
-        if (combo->layers[j] == layer) {
-            return true;
+// Add each combo to the set of every key position and layer it uses, once the ids are final.
+static void initialize_combo_lookup() {
+    for (int id = 0; id < combos_len; id++) {
+        struct combo_cfg *combo = combos[id];
+        for (int i = 0; i < combo->key_position_len; i++) {
+            combo_set_add(combo_lookup[combo->key_positions[i]], id);
+        }
+
+        if (combo->layers[0] == -1) {
+            // -1 in the first layer position is global layer scope
+            for (int layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+                combo_set_add(layer_combos[layer], id);
+            }
+            continue;
+        }
+        for (int j = 0; j < combo->layers_len; j++) {
+            if (combo->layers[j] >= 0 && combo->layers[j] < ZMK_KEYMAP_LAYERS_LEN) {
+                combo_set_add(layer_combos[combo->layers[j]], id);
+            }
         }
     }
-    return false;
 }
 
 static int setup_candidates_for_first_keypress(int32_t position, int64_t timestamp) {
-    int number_of_combo_candidates = 0;
     uint8_t highest_active_layer = zmk_keymap_highest_layer_active();
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        struct combo_cfg *combo = combo_lookup[position][i];
-        if (combo == NULL) {
-            return number_of_combo_candidates;
-        }
-        if (combo_active_on_layer(combo, highest_active_layer)) {
-            candidates[number_of_combo_candidates].combo = combo;
-            candidates[number_of_combo_candidates].timeout_at = timestamp + combo->timeout_ms;
-            number_of_combo_candidates++;
-        }
-        // LOG_DBG("combo timeout %d %d %d", position, i, candidates[i].timeout_at);
+    for (int i = 0; i < COMBO_SET_WORDS; i++) {
+        candidates[i] = combo_lookup[position][i] & layer_combos[highest_active_layer][i];
     }
-    return number_of_combo_candidates;
+    candidates_pressed_at = timestamp;
+    return combo_set_count(candidates);
 }
 
 static int filter_candidates(int32_t position) {
-    // this code iterates over candidates and the lookup together to filter in O(n)
-    // assuming they are both sorted on key_position_len, virtal_key_position
-    int matches = 0, lookup_idx = 0, candidate_idx = 0;
-    while (lookup_idx < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY &&
-           candidate_idx < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY) {
-        struct combo_cfg *candidate = candidates[candidate_idx].combo;
-        struct combo_cfg *lookup = combo_lookup[position][lookup_idx];
-        if (candidate == NULL || lookup == NULL) {
-            break;
-        }
-        if (candidate->virtual_key_position == lookup->virtual_key_position) {
-            candidates[matches] = candidates[candidate_idx];
-            matches++;
-            candidate_idx++;
-            lookup_idx++;
-        } else if (candidate->key_position_len > lookup->key_position_len) {
-            lookup_idx++;
-        } else if (candidate->key_position_len < lookup->key_position_len) {
-            candidate_idx++;
-        } else if (candidate->virtual_key_position > lookup->virtual_key_position) {
-            lookup_idx++;
-        } else if (candidate->virtual_key_position < lookup->virtual_key_position) {
-            candidate_idx++;
-        }
-    }
-    // clear unmatched candidates
-    for (int i = matches; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        candidates[i].combo = NULL;
+    for (int i = 0; i < COMBO_SET_WORDS; i++) {
+        candidates[i] &= combo_lookup[position][i];
     }
+    int matches = combo_set_count(candidates);
     // LOG_DBG("combo matches after filter %d", matches);
     return matches;
 }
 
+static inline struct combo_cfg *first_candidate() {
+    int id = combo_set_next(candidates, -1);
+    return id < 0 ? NULL : combos[id];
+}
+
 static int64_t first_candidate_timeout() {
-    int64_t first_timeout = LONG_MAX;
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        if (candidates[i].combo == NULL) {
-            break;
-        }
-        if (candidates[i].timeout_at < first_timeout) {
-            first_timeout = candidates[i].timeout_at;
+    int64_t first_timeout = LLONG_MAX;
+    FOR_EACH_CANDIDATE(id) {
+        int64_t timeout_at = candidates_pressed_at + combos[id]->timeout_ms;
+        if (timeout_at < first_timeout) {
+            first_timeout = timeout_at;
         }
     }
     return first_timeout;
@@ -187,48 +194,26 @@ static int64_t first_candidate_timeout() {
 
 static inline bool candidate_is_completely_pressed(struct combo_cfg *candidate) {
     // this code assumes set(pressed_keys) <= set(candidate->key_positions)
-    // this invariant is enforced by filter_candidates
-    // since events may have been reraised after clearing one or more slots at
-    // the start of pressed_keys (see: release_pressed_keys), we have to check
-    // that each key needed to trigger the combo was pressed, not just the last.
-    for (int i = 0; i < candidate->key_position_len; i++) {
-        if (pressed_keys[i] == NULL) {
-            return false;
-        }
-    }
-    return true;
+    // this invariant is enforced by filter_candidates, so the candidate is
+    // completely pressed once it has as many keys as there are pressed keys.
+    return pressed_keys_count >= candidate->key_position_len;
 }
 
 static int cleanup();
 
 static int filter_timed_out_candidates(int64_t timestamp) {
     int num_candidates = 0;
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        struct combo_candidate *candidate = &candidates[i];
-        if (candidate->combo == NULL) {
-            break;
-        }
-        if (candidate->timeout_at > timestamp) {
-            // reorder candidates so they're contiguous
-            candidates[num_candidates].combo = candidate->combo;
-            candidates[num_candidates].timeout_at = candidate->timeout_at;
+    FOR_EACH_CANDIDATE(id) {
+        if (candidates_pressed_at + combos[id]->timeout_ms > timestamp) {
             num_candidates++;
         } else {
-            candidate->combo = NULL;
+            combo_set_remove(candidates, id);
         }
     }
     return num_candidates;
 }
 
-static int clear_candidates() {
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        if (candidates[i].combo == NULL) {
-            return i;
-        }
-        candidates[i].combo = NULL;
-    }
-    return CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY;
-}
+static void clear_candidates() { memset(candidates, 0, sizeof(candidates)); }
 
 static int capture_pressed_key(const zmk_event_t *ev) {
     for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO; i++) {
@@ -236,6 +221,7 @@ static int capture_pressed_key(const zmk_event_t *ev) {
             continue;
         }
         pressed_keys[i] = ev;
+        pressed_keys_count++;
         return ZMK_EV_EVENT_CAPTURED;
     }
     return 0;
@@ -244,12 +230,16 @@ static int capture_pressed_key(const zmk_event_t *ev) {
 const struct zmk_listener zmk_listener_combo;
 
 static int release_pressed_keys() {
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO; i++) {
-        const zmk_event_t *captured_event = pressed_keys[i];
-        if (pressed_keys[i] == NULL) {
-            return i;
-        }
-        pressed_keys[i] = NULL;
+    // take all keys out of pressed_keys first, so reraised events are captured
+    // into an empty set and pressed_keys stays contiguous.
+    const zmk_event_t *released_keys[CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO];
+    int count = pressed_keys_count;
+    memcpy(released_keys, pressed_keys, sizeof(released_keys));
+    memset(pressed_keys, 0, sizeof(pressed_keys));
+    pressed_keys_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        const zmk_event_t *captured_event = released_keys[i];
         if (i == 0) {
             LOG_DBG("combo: releasing position event %d",
                     as_zmk_position_state_changed(captured_event)->position);
@@ -261,7 +251,7 @@ static int release_pressed_keys() {
             ZMK_EVENT_RAISE(captured_event);
         }
     }
-    return CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO;
+    return count;
 }
 
 static inline int press_combo_behavior(struct combo_cfg *combo, int32_t timestamp) {
@@ -288,6 +278,7 @@ static void move_pressed_keys_to_active_combo(struct active_combo *active_combo)
         active_combo->key_positions_pressed[i] = pressed_keys[i];
         pressed_keys[i] = NULL;
     }
+    pressed_keys_count -= combo_length;
     // move any other pressed keys up
     for (int i = 0; i + combo_length < CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO; i++) {
         if (pressed_keys[i + combo_length] == NULL) {
@@ -389,14 +380,15 @@ static void update_timeout_task() {
         k_work_cancel_delayable(&timeout_task);
         return;
     }
-    if (k_work_schedule(&timeout_task, K_MSEC(first_timeout - k_uptime_get())) >= 0) {
+    if (k_work_schedule_for_queue(zmk_workqueue_input_work_q(), &timeout_task,
+                                  K_MSEC(first_timeout - k_uptime_get())) >= 0) {
         timeout_task_timeout_at = first_timeout;
     }
 }
 
 static int position_state_down(const zmk_event_t *ev, struct zmk_position_state_changed *data) {
     int num_candidates;
-    if (candidates[0].combo == NULL) {
+    if (first_candidate() == NULL) {
         num_candidates = setup_candidates_for_first_keypress(data->position, data->timestamp);
         if (num_candidates == 0) {
             return 0;
@@ -407,7 +399,7 @@ static int position_state_down(const zmk_event_t *ev, struct zmk_position_state_
     }
     update_timeout_task();
 
-    struct combo_cfg *candidate_combo = candidates[0].combo;
+    struct combo_cfg *candidate_combo = first_candidate();
     LOG_DBG("combo: capturing position event %d", data->position);
     int ret = capture_pressed_key(ev);
     switch (num_candidates) {
@@ -488,6 +480,7 @@ DT_INST_FOREACH_CHILD(0, COMBO_INST)
 static int combo_init() {
     k_work_init_delayable(&timeout_task, combo_timeout_handler);
     DT_INST_FOREACH_CHILD(0, INITIALIZE_COMBO);
+    initialize_combo_lookup();
     return 0;
 }
 
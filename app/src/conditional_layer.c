@@ -26,23 +26,38 @@ static K_SEM_DEFINE(conditional_layer_sem, 1, 1);
 // active. With two if-layers, this is referred to as "tri-layer", and is commonly used to activate
 // a third "adjust" layer if and only if the "lower" and "raise" layers are both active.
 struct conditional_layer_cfg {
-    // A bitmask of each layer that must be pressed for this conditional layer config to activate.
-    zmk_keymap_layers_state_t if_layers_state_mask;
+    // The layers that must all be active for this conditional layer config to activate.
+    const uint8_t *if_layers;
+    size_t if_layers_len;
 
     // The layer number that should be active while all layers in the if-layers mask are active.
-    int8_t then_layer;
+    uint8_t then_layer;
 };
 
-#define IF_LAYER_BIT(i, n) BIT(DT_PROP_BY_IDX(n, if_layers, i)) |
+#define IF_LAYERS_DECL(n) static const uint8_t if_layers_##n[] = DT_PROP(n, if_layers);
 
 // Evaluates to conditional_layer_cfg struct initializer.
 #define CONDITIONAL_LAYER_DECL(n)                                                                  \
     {                                                                                              \
-        /* TODO: Replace UTIL_LISTIFY with DT_FOREACH_PROP_ELEM after Zepyhr 2.6.0 upgrade. */     \
-        .if_layers_state_mask = UTIL_LISTIFY(DT_PROP_LEN(n, if_layers), IF_LAYER_BIT, n) 0,        \
+        .if_layers = if_layers_##n,                                                                \
+        .if_layers_len = DT_PROP_LEN(n, if_layers),                                                \
         .then_layer = DT_PROP(n, then_layer),                                                      \
     },
 
+DT_INST_FOREACH_CHILD(0, IF_LAYERS_DECL)
+
+// The layer masks only have room for the layers of the keymap.
+#define IF_LAYER_CHECK(idx, n)                                                                     \
+    BUILD_ASSERT(DT_PROP_BY_IDX(n, if_layers, idx) < ZMK_KEYMAP_LAYERS_LEN,                        \
+                 "Conditional layer if-layers must be layers of the keymap");
+
+#define CONDITIONAL_LAYER_CHECK(n)                                                                 \
+    UTIL_LISTIFY(DT_PROP_LEN(n, if_layers), IF_LAYER_CHECK, n)                                     \
+    BUILD_ASSERT(DT_PROP(n, then_layer) < ZMK_KEYMAP_LAYERS_LEN,                                   \
+                 "Conditional layer then-layer must be a layer of the keymap");
+
+DT_INST_FOREACH_CHILD(0, CONDITIONAL_LAYER_CHECK)
+
 // All conditional layer configurations in the keymap.
 static const struct conditional_layer_cfg CONDITIONAL_LAYER_CFGS[] = {
     DT_INST_FOREACH_CHILD(0, CONDITIONAL_LAYER_DECL)};
@@ -50,7 +65,15 @@ static const struct conditional_layer_cfg CONDITIONAL_LAYER_CFGS[] = {
 static const int32_t NUM_CONDITIONAL_LAYER_CFGS =
     sizeof(CONDITIONAL_LAYER_CFGS) / sizeof(*CONDITIONAL_LAYER_CFGS);
 
-static void conditional_layer_activate(int8_t layer) {
+// A bitmask of each layer that must be pressed for each conditional layer config to activate.
+// The layer state is wider than any integer literal on big keymaps, so these are built at init.
+static zmk_keymap_layers_state_t if_layers_state_masks[ARRAY_SIZE(CONDITIONAL_LAYER_CFGS)];
+
+// The union of all then-layers, used to only visit layers that conditional layers control.
+static zmk_keymap_layers_state_t then_layers;
+static int max_then_layer = -1;
+
+static void conditional_layer_activate(uint8_t layer) {
     // This may trigger another event that could, in turn, activate additional then-layers. However,
     // the process will eventually terminate (at worst, when every layer is active).
     if (!zmk_keymap_layer_active(layer)) {
@@ -59,7 +82,7 @@ static void conditional_layer_activate(int8_t layer) {
     }
 }
 
-static void conditional_layer_deactivate(int8_t layer) {
+static void conditional_layer_deactivate(uint8_t layer) {
     // This may deactivate a then-layer that's already active via another mechanism (e.g., a
     // momentary layer behavior). However, the same problem arises when multiple keys with the same
     // &mo binding are held and then one is released, so it's probably not an issue in practice.
@@ -82,9 +105,7 @@ static int layer_state_changed_listener(const zmk_event_t *ev) {
     }
 
     while (conditional_layer_updates_needed) {
-        int8_t max_then_layer = -1;
-        uint32_t then_layers = 0;
-        uint32_t then_layer_state = 0;
+        zmk_keymap_layers_state_t then_layer_state = {0};
 
         conditional_layer_updates_needed = false;
 
@@ -92,21 +113,19 @@ static int layer_state_changed_listener(const zmk_event_t *ev) {
         // in the config should activate based on the currently active set of if-layers.
         for (int i = 0; i < NUM_CONDITIONAL_LAYER_CFGS; i++) {
             const struct conditional_layer_cfg *cfg = CONDITIONAL_LAYER_CFGS + i;
-            zmk_keymap_layers_state_t mask = cfg->if_layers_state_mask;
-            then_layers |= BIT(cfg->then_layer);
-            max_then_layer = MAX(max_then_layer, cfg->then_layer);
+            zmk_keymap_layers_state_t layer_state = zmk_keymap_layer_state();
 
             // Activate then-layer if and only if all if-layers are already active. Note that we
             // reevaluate the current layer state for each config since activation of one layer can
             // also trigger activation of another.
-            if ((zmk_keymap_layer_state() & mask) == mask) {
-                then_layer_state |= BIT(cfg->then_layer);
+            if (zmk_keymap_layers_state_contains(&layer_state, &if_layers_state_masks[i])) {
+                zmk_keymap_layers_state_write(&then_layer_state, cfg->then_layer, true);
             }
         }
 
         for (uint8_t layer = 0; layer <= max_then_layer; layer++) {
-            if ((BIT(layer) & then_layers) != 0U) {
-                if ((BIT(layer) & then_layer_state) != 0U) {
+            if (zmk_keymap_layers_state_test(&then_layers, layer)) {
+                if (zmk_keymap_layers_state_test(&then_layer_state, layer)) {
                     conditional_layer_activate(layer);
                 } else {
                     conditional_layer_deactivate(layer);
@@ -119,6 +138,22 @@ static int layer_state_changed_listener(const zmk_event_t *ev) {
     return 0;
 }
 
+static int conditional_layer_init(const struct device *_arg) {
+    for (int i = 0; i < NUM_CONDITIONAL_LAYER_CFGS; i++) {
+        const struct conditional_layer_cfg *cfg = CONDITIONAL_LAYER_CFGS + i;
+
+        for (int j = 0; j < cfg->if_layers_len; j++) {
+            zmk_keymap_layers_state_write(&if_layers_state_masks[i], cfg->if_layers[j], true);
+        }
+        zmk_keymap_layers_state_write(&then_layers, cfg->then_layer, true);
+        max_then_layer = MAX(max_then_layer, cfg->then_layer);
+    }
+
+    return 0;
+}
+
+SYS_INIT(conditional_layer_init, APPLICATION, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
 ZMK_LISTENER(conditional_layer, layer_state_changed_listener);
 ZMK_SUBSCRIPTION(conditional_layer, zmk_layer_state_changed);
 
@@ -5,6 +5,7 @@
  */
 
 #include <init.h>
+#include <string.h>
 #include <settings/settings.h>
 
 #include <zmk/ble.h>
@@ -17,6 +18,8 @@
 #include <zmk/events/ble_active_profile_changed.h>
 #include <zmk/events/usb_conn_state_changed.h>
 #include <zmk/events/endpoint_selection_changed.h>
+#include <zmk/latency.h>
+#include <zmk/workqueue.h>
 
 #include <logging/log.h>
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
@@ -130,20 +133,146 @@ static int send_consumer_report() {
     }
 }
 
-int zmk_endpoints_send_report(uint16_t usage_page) {
+#define ENDPOINT_COUNT (ZMK_ENDPOINT_BLE + 1)
+
+// The last report sent to each endpoint. A report identical to the last one sent is not sent
+// again. The shadows are invalidated whenever the host on the other end may have changed.
+struct report_shadow {
+    bool valid;
+    uint8_t data[MAX(sizeof(struct zmk_hid_keyboard_report),
+                     sizeof(struct zmk_hid_consumer_report))];
+};
+
+static struct report_shadow last_keyboard_reports[ENDPOINT_COUNT];
+static struct report_shadow last_consumer_reports[ENDPOINT_COUNT];
+static struct zmk_endpoints_report_counts report_counts;
+
+static void invalidate_report_shadows() {
+    memset(last_keyboard_reports, 0, sizeof(last_keyboard_reports));
+    memset(last_consumer_reports, 0, sizeof(last_consumer_reports));
+}
+
+static int send_report_if_changed(struct report_shadow *shadow, const void *report, size_t len,
+                                  int (*send)()) {
+    if (shadow->valid && memcmp(shadow->data, report, len) == 0) {
+        LOG_DBG("Report unchanged, not sending");
+        report_counts.suppressed++;
+        return 0;
+    }
+
+    int err = send();
+    if (err) {
+        // the host may or may not have received it, so the next report is always sent.
+        shadow->valid = false;
+        return err;
+    }
+
+    memcpy(shadow->data, report, len);
+    shadow->valid = true;
+    report_counts.sent++;
+    return 0;
+}
+
+struct zmk_endpoints_report_counts zmk_endpoints_get_report_counts() { return report_counts; }
+
+static int send_report(uint16_t usage_page) {
+    zmk_latency_stamp(ZMK_LATENCY_STAGE_REPORT);
 
     LOG_DBG("usage page 0x%02X", usage_page);
     switch (usage_page) {
     case HID_USAGE_KEY:
-        return send_keyboard_report();
+        return send_report_if_changed(&last_keyboard_reports[current_endpoint],
+                                      zmk_hid_get_keyboard_report(),
+                                      sizeof(struct zmk_hid_keyboard_report), send_keyboard_report);
     case HID_USAGE_CONSUMER:
-        return send_consumer_report();
+        return send_report_if_changed(&last_consumer_reports[current_endpoint],
+                                      zmk_hid_get_consumer_report(),
+                                      sizeof(struct zmk_hid_consumer_report), send_consumer_report);
     default:
         LOG_ERR("Unsupported usage page %d", usage_page);
         return -ENOTSUP;
     }
 }
 
+#if IS_ENABLED(CONFIG_ZMK_HID_BATCH_REPORTS)
+
+#define BATCH_MAX_USAGES 16
+
+// While a batch is open, reports are only marked as pending. The usages changed since the
+// pending reports were last sent are tracked, so a second change to the same usage flushes
+// the first one and no press or release is lost. They all share one usage page, so the
+// reports go out in the order the changes happened. Only a consumer usage with modifiers
+// makes both reports pending, and its keyboard report has to be sent first.
+static int batch_depth = 0;
+static uint32_t batch_usages[BATCH_MAX_USAGES];
+static int batch_usages_len = 0;
+static bool batch_flush_before_next = false;
+static bool batch_keyboard_pending = false;
+static bool batch_consumer_pending = false;
+
+static void batch_flush() {
+    batch_usages_len = 0;
+    batch_flush_before_next = false;
+
+    if (batch_keyboard_pending) {
+        batch_keyboard_pending = false;
+        send_report(HID_USAGE_KEY);
+    }
+    if (batch_consumer_pending) {
+        batch_consumer_pending = false;
+        send_report(HID_USAGE_CONSUMER);
+    }
+}
+
+void zmk_endpoints_batch_begin() { batch_depth++; }
+
+void zmk_endpoints_batch_end() {
+    if (batch_depth > 0 && --batch_depth == 0) {
+        batch_flush();
+    }
+}
+
+void zmk_endpoints_batch_add(uint32_t usage, bool ordered) {
+    if (batch_depth == 0) {
+        return;
+    }
+
+    bool flush = batch_flush_before_next || ordered || batch_usages_len == BATCH_MAX_USAGES ||
+                 (batch_usages_len > 0 &&
+                  ZMK_HID_USAGE_PAGE(batch_usages[0]) != ZMK_HID_USAGE_PAGE(usage));
+    for (int i = 0; !flush && i < batch_usages_len; i++) {
+        flush = batch_usages[i] == usage;
+    }
+    if (flush) {
+        batch_flush();
+    }
+
+    batch_usages[batch_usages_len++] = usage;
+    // modifiers change the meaning of other keys, so they are sent in a report of their own
+    batch_flush_before_next = ordered;
+}
+
+int zmk_endpoints_send_report(uint16_t usage_page) {
+    if (batch_depth > 0) {
+        switch (usage_page) {
+        case HID_USAGE_KEY:
+            batch_keyboard_pending = true;
+            return 0;
+        case HID_USAGE_CONSUMER:
+            batch_consumer_pending = true;
+            return 0;
+        }
+    }
+
+    return send_report(usage_page);
+}
+
+#else
+
+int zmk_endpoints_send_report(uint16_t usage_page) { return send_report(usage_page); }
+
+#endif /* IS_ENABLED(CONFIG_ZMK_HID_BATCH_REPORTS) */
+
 #if IS_ENABLED(CONFIG_SETTINGS)
 
 static int endpoints_handle_set(const char *name, size_t len, settings_read_cb read_cb,
@@ -242,14 +371,25 @@ static void update_current_endpoint() {
 
         current_endpoint = new_endpoint;
         LOG_INF("Endpoint changed: %d", current_endpoint);
+        invalidate_report_shadows();
 
         ZMK_EVENT_RAISE(new_zmk_endpoint_selection_changed(
             (struct zmk_endpoint_selection_changed){.endpoint = current_endpoint}));
     }
 }
 
-static int endpoint_listener(const zmk_event_t *eh) {
+static void endpoint_update_work_cb(struct k_work *work) {
+    // a connection or profile change means the host may not have seen the last reports
+    invalidate_report_shadows();
     update_current_endpoint();
+}
+
+K_WORK_DEFINE(endpoint_update_work, endpoint_update_work_cb);
+
+static int endpoint_listener(const zmk_event_t *eh) {
+    // Connection events are raised from the system work queue, switch endpoints on the input work
+    // queue so it does not race with reports being sent for key presses.
+    k_work_submit_to_queue(zmk_workqueue_input_work_q(), &endpoint_update_work);
     return 0;
 }
 
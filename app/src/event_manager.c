@@ -11,22 +11,95 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #include <zmk/event_manager.h>
 
-extern struct zmk_event_type *__event_type_start[];
-extern struct zmk_event_type *__event_type_end[];
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL_STATS)
+static void update_pool_max_used(struct zmk_event_pool *pool) {
+    atomic_val_t used = k_mem_slab_num_used_get(pool->slab);
+    atomic_val_t max_used;
+    do {
+        max_used = atomic_get(&pool->max_used);
+    } while (used > max_used && !atomic_cas(&pool->max_used, max_used, used));
+}
+#endif
+
+zmk_event_t *zmk_event_manager_alloc(const struct zmk_event_type *event_type, size_t size) {
+    zmk_event_t *event;
+    bool from_pool = true;
+
+    if (k_mem_slab_alloc(event_type->pool->slab, (void **)&event, K_NO_WAIT) != 0) {
+        LOG_DBG("Event pool for %s exhausted, falling back to heap", event_type->name);
+        atomic_inc(&event_type->pool->heap_fallbacks);
+        from_pool = false;
+        event = k_malloc(size);
+        if (event == NULL) {
+            LOG_ERR("Failed to allocate %s event", event_type->name);
+            return NULL;
+        }
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL_STATS)
+    if (from_pool) {
+        update_pool_max_used(event_type->pool);
+    }
+#endif
+
+    event->event = event_type;
+    event->last_listener_index = 0;
+    event->from_pool = from_pool;
+    return event;
+}
+
+void zmk_event_manager_free(zmk_event_t *event) {
+    if (event->from_pool) {
+        k_mem_slab_free(event->event->pool->slab, (void **)&event);
+    } else {
+        k_free(event);
+    }
+}
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS)
+
+static int invoke_listener(const struct zmk_event_subscription *ev_sub, zmk_event_t *event) {
+    struct zmk_listener_stats *stats = ev_sub->stats;
+    uint32_t start = k_cycle_get_32();
+    int ret = ev_sub->listener->callback(event);
+    // Cycles include any events raised synchronously from within the listener
+    uint32_t cycles = k_cycle_get_32() - start;
+
+    stats->calls++;
+    stats->total_cycles += cycles;
+    stats->max_cycles = MAX(stats->max_cycles, cycles);
+    switch (ret) {
+    case ZMK_EV_EVENT_BUBBLE:
+        stats->bubbled++;
+        break;
+    case ZMK_EV_EVENT_HANDLED:
+        stats->handled++;
+        break;
+    case ZMK_EV_EVENT_CAPTURED:
+        stats->captured++;
+        break;
+    }
+
+    return ret;
+}
+
+#else
+
+static inline int invoke_listener(const struct zmk_event_subscription *ev_sub,
+                                  zmk_event_t *event) {
+    return ev_sub->listener->callback(event);
+}
 
-extern struct zmk_event_subscription __event_subscriptions_start[];
-extern struct zmk_event_subscription __event_subscriptions_end[];
+#endif /* IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS) */
 
 int zmk_event_manager_handle_from(zmk_event_t *event, uint8_t start_index) {
     int ret = 0;
-    uint8_t len = __event_subscriptions_end - __event_subscriptions_start;
+    const struct zmk_event_subscription *subs = event->event->subscriptions_start;
+    uint8_t len = event->event->subscriptions_end - subs;
     for (int i = start_index; i < len; i++) {
-        struct zmk_event_subscription *ev_sub = __event_subscriptions_start + i;
-        if (ev_sub->event_type != event->event) {
-            continue;
-        }
+        const struct zmk_event_subscription *ev_sub = subs + i;
         event->last_listener_index = i;
-        ret = ev_sub->listener->callback(event);
+        ret = invoke_listener(ev_sub, event);
         switch (ret) {
         case ZMK_EV_EVENT_BUBBLE:
             continue;
@@ -45,42 +118,143 @@ int zmk_event_manager_handle_from(zmk_event_t *event, uint8_t start_index) {
     }
 
 release:
-    k_free(event);
+    zmk_event_manager_free(event);
     return ret;
 }
 
-int zmk_event_manager_raise(zmk_event_t *event) { return zmk_event_manager_handle_from(event, 0); }
+static int find_listener_index(const zmk_event_t *event, const struct zmk_listener *listener) {
+    const struct zmk_event_subscription *subs = event->event->subscriptions_start;
+    uint8_t len = event->event->subscriptions_end - subs;
 
-int zmk_event_manager_raise_after(zmk_event_t *event, const struct zmk_listener *listener) {
-    uint8_t len = __event_subscriptions_end - __event_subscriptions_start;
-    for (int i = 0; i < len; i++) {
-        struct zmk_event_subscription *ev_sub = __event_subscriptions_start + i;
+    // Captured and re-raised events resume at the listener that last handled them,
+    // so check that one before searching the rest of the slice.
+    if (event->last_listener_index < len && subs[event->last_listener_index].listener == listener) {
+        return event->last_listener_index;
+    }
 
-        if (ev_sub->event_type == event->event && ev_sub->listener == listener) {
-            return zmk_event_manager_handle_from(event, i + 1);
+    for (int i = 0; i < len; i++) {
+        if (subs[i].listener == listener) {
+            return i;
         }
     }
 
-    LOG_WRN("Unable to find where to raise this after event");
-
     return -EINVAL;
 }
 
-int zmk_event_manager_raise_at(zmk_event_t *event, const struct zmk_listener *listener) {
-    uint8_t len = __event_subscriptions_end - __event_subscriptions_start;
-    for (int i = 0; i < len; i++) {
-        struct zmk_event_subscription *ev_sub = __event_subscriptions_start + i;
+int zmk_event_manager_raise(zmk_event_t *event) { return zmk_event_manager_handle_from(event, 0); }
 
-        if (ev_sub->event_type == event->event && ev_sub->listener == listener) {
-            return zmk_event_manager_handle_from(event, i);
-        }
+int zmk_event_manager_raise_after(zmk_event_t *event, const struct zmk_listener *listener) {
+    int index = find_listener_index(event, listener);
+    if (index < 0) {
+        LOG_WRN("Unable to find where to raise this after event");
+        return index;
     }
 
-    LOG_WRN("Unable to find where to raise this event");
+    return zmk_event_manager_handle_from(event, index + 1);
+}
 
-    return -EINVAL;
+int zmk_event_manager_raise_at(zmk_event_t *event, const struct zmk_listener *listener) {
+    int index = find_listener_index(event, listener);
+    if (index < 0) {
+        LOG_WRN("Unable to find where to raise this event");
+        return index;
+    }
+
+    return zmk_event_manager_handle_from(event, index);
 }
 
 int zmk_event_manager_release(zmk_event_t *event) {
     return zmk_event_manager_handle_from(event, event->last_listener_index + 1);
 }
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL_STATS)
+
+extern const struct zmk_event_type *__event_type_start[];
+extern const struct zmk_event_type *__event_type_end[];
+
+void zmk_event_manager_log_pool_stats(void) {
+    for (const struct zmk_event_type **type = __event_type_start; type < __event_type_end;
+         type++) {
+        struct zmk_event_pool *pool = (*type)->pool;
+        LOG_INF("Event pool %s: %d/%d blocks in use, high-water mark %d, %d heap fallbacks",
+                (*type)->name, k_mem_slab_num_used_get(pool->slab), pool->slab->num_blocks,
+                (int)atomic_get(&pool->max_used), (int)atomic_get(&pool->heap_fallbacks));
+    }
+}
+
+#endif /* IS_ENABLED(CONFIG_ZMK_EVENT_POOL_STATS) */
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS)
+
+extern const struct zmk_event_subscription __event_subscriptions_start[];
+extern const struct zmk_event_subscription __event_subscriptions_end[];
+
+void zmk_event_manager_log_listener_stats(void) {
+    for (const struct zmk_event_subscription *ev_sub = __event_subscriptions_start;
+         ev_sub < __event_subscriptions_end; ev_sub++) {
+        const struct zmk_listener_stats *stats = ev_sub->stats;
+        LOG_INF("%s -> %s: %u calls (%u bubbled, %u handled, %u captured), %u us total, "
+                "%u max cycles",
+                ev_sub->event_type->name, ev_sub->listener->name, stats->calls, stats->bubbled,
+                stats->handled, stats->captured,
+                (uint32_t)k_cyc_to_us_floor64(stats->total_cycles), stats->max_cycles);
+    }
+}
+
+void zmk_event_manager_reset_listener_stats(void) {
+    for (const struct zmk_event_subscription *ev_sub = __event_subscriptions_start;
+         ev_sub < __event_subscriptions_end; ev_sub++) {
+        memset(ev_sub->stats, 0, sizeof(struct zmk_listener_stats));
+    }
+}
+
+#if IS_ENABLED(CONFIG_SHELL)
+#include <shell/shell.h>
+
+static int cmd_listener_stats(const struct shell *shell, size_t argc, char **argv) {
+    for (const struct zmk_event_subscription *ev_sub = __event_subscriptions_start;
+         ev_sub < __event_subscriptions_end; ev_sub++) {
+        const struct zmk_listener_stats *stats = ev_sub->stats;
+        shell_print(shell, "%-32s %-24s %8u %8u %8u %8u %10u %8u", ev_sub->event_type->name,
+                    ev_sub->listener->name, stats->calls, stats->bubbled, stats->handled,
+                    stats->captured, (uint32_t)k_cyc_to_us_floor64(stats->total_cycles),
+                    stats->max_cycles);
+    }
+
+    return 0;
+}
+
+static int cmd_listener_stats_reset(const struct shell *shell, size_t argc, char **argv) {
+    zmk_event_manager_reset_listener_stats();
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_listener_stats,
+                               SHELL_CMD(reset, NULL, "Reset listener statistics",
+                                         cmd_listener_stats_reset),
+                               SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(zmk_listeners, &sub_listener_stats,
+                   "Print per-listener call counts and cycles "
+                   "(event, listener, calls, bubbled, handled, captured, total us, max cycles)",
+                   cmd_listener_stats);
+#endif /* IS_ENABLED(CONFIG_SHELL) */
+
+#endif /* IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS) */
+
+#if IS_ENABLED(CONFIG_ARCH_POSIX) &&                                                               \
+    (IS_ENABLED(CONFIG_ZMK_EVENT_POOL_STATS) || IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS))
+#include <soc.h>
+
+static void log_stats_on_exit(void) {
+    LOG_PANIC();
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL_STATS)
+    zmk_event_manager_log_pool_stats();
+#endif
+#if IS_ENABLED(CONFIG_ZMK_EVENT_LISTENER_STATS)
+    zmk_event_manager_log_listener_stats();
+#endif
+}
+
+NATIVE_TASK(log_stats_on_exit, ON_EXIT, 1);
+#endif
@@ -7,4 +7,4 @@
 #include <kernel.h>
 #include <zmk/events/position_state_changed.h>
 
-ZMK_EVENT_IMPL(zmk_position_state_changed);
\ No newline at end of file
+ZMK_EVENT_IMPL_POOL(zmk_position_state_changed, CONFIG_ZMK_EVENT_POSITION_POOL_SIZE);
\ No newline at end of file
@@ -271,3 +271,37 @@ struct zmk_hid_keyboard_report *zmk_hid_get_keyboard_report() {
 struct zmk_hid_consumer_report *zmk_hid_get_consumer_report() {
     return &consumer_report;
 }
+
+// No bit may change both from `prev` to `last` and from `last` to `next`, or a press and its
+// release would collapse into nothing. New presses may only come from one of the two reports, so
+// the host sees them in order, and modifier changes are not merged with key changes, so a key
+// never appears with the wrong modifiers.
+bool zmk_hid_report_can_coalesce(const uint8_t *prev, const uint8_t *last, const uint8_t *next,
+                                 size_t len, size_t mods_len) {
+    bool pressed_in_last = false;
+    bool pressed_in_next = false;
+    bool mods_changed = false;
+    bool keys_changed = false;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t first = prev[i] ^ last[i];
+        uint8_t second = last[i] ^ next[i];
+
+        if (first & second) {
+            return false;
+        }
+
+        pressed_in_last |= (first & last[i]) != 0;
+        pressed_in_next |= (second & next[i]) != 0;
+
+        if (first | second) {
+            if (i < mods_len) {
+                mods_changed = true;
+            } else {
+                keys_changed = true;
+            }
+        }
+    }
+
+    return !(pressed_in_last && pressed_in_next) && !(mods_changed && keys_changed);
+}
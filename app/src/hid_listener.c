@@ -15,12 +15,19 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 #include <zmk/hid.h>
 #include <dt-bindings/zmk/hid_usage_pages.h>
 #include <zmk/endpoints.h>
+#include <zmk/latency.h>
+
+static inline bool changes_modifiers(const struct zmk_keycode_state_changed *ev) {
+    return is_mod(ev->usage_page, ev->keycode) || ev->implicit_modifiers != 0 ||
+           ev->explicit_modifiers != 0;
+}
 
 static int hid_listener_keycode_pressed(const struct zmk_keycode_state_changed *ev) {
     int err, explicit_mods_changed, implicit_mods_changed;
 
     LOG_DBG("usage_page 0x%02X keycode 0x%02X implicit_mods 0x%02X explicit_mods 0x%02X",
             ev->usage_page, ev->keycode, ev->implicit_modifiers, ev->explicit_modifiers);
+    zmk_endpoints_batch_add(ZMK_HID_USAGE(ev->usage_page, ev->keycode), changes_modifiers(ev));
     err = zmk_hid_press(ZMK_HID_USAGE(ev->usage_page, ev->keycode));
     if (err < 0) {
         LOG_DBG("Unable to press keycode");
@@ -45,6 +52,7 @@ static int hid_listener_keycode_released(const struct zmk_keycode_state_changed
 
     LOG_DBG("usage_page 0x%02X keycode 0x%02X implicit_mods 0x%02X explicit_mods 0x%02X",
             ev->usage_page, ev->keycode, ev->implicit_modifiers, ev->explicit_modifiers);
+    zmk_endpoints_batch_add(ZMK_HID_USAGE(ev->usage_page, ev->keycode), changes_modifiers(ev));
     err = zmk_hid_release(ZMK_HID_USAGE(ev->usage_page, ev->keycode));
     if (err < 0) {
         LOG_DBG("Unable to release keycode");
@@ -73,6 +81,7 @@ static int hid_listener_keycode_released(const struct zmk_keycode_state_changed
 int hid_listener(const zmk_event_t *eh) {
     const struct zmk_keycode_state_changed *ev = as_zmk_keycode_state_changed(eh);
     if (ev) {
+        zmk_latency_stamp(ZMK_LATENCY_STAGE_KEYCODE);
         if (ev->state) {
             hid_listener_keycode_pressed(ev);
         } else {
@@ -143,125 +143,244 @@ BT_GATT_SERVICE_DEFINE(
                            BT_GATT_PERM_WRITE, NULL, write_ctrl_point, &ctrl_point));
 
 struct bt_conn *destination_connection() {
-    struct bt_conn *conn;
-    bt_addr_le_t *addr = zmk_ble_active_profile_addr();
-    LOG_DBG("Address pointer %p", addr);
-    if (!bt_addr_le_cmp(addr, BT_ADDR_LE_ANY)) {
+    struct bt_conn *conn = zmk_ble_active_profile_conn();
+    if (conn != NULL) {
+        return conn;
+    }
+
+    if (zmk_ble_active_profile_is_open()) {
         LOG_WRN("Not sending, no active address for current profile");
-        return NULL;
-    } else if ((conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, addr)) == NULL) {
+    } else {
         LOG_WRN("Not sending, not connected to active profile");
-        return NULL;
     }
 
-    return conn;
+    return NULL;
 }
 
 K_THREAD_STACK_DEFINE(hog_q_stack, CONFIG_ZMK_BLE_THREAD_STACK_SIZE);
 
 struct k_work_q hog_work_q;
 
-K_MSGQ_DEFINE(zmk_hog_keyboard_msgq, sizeof(struct zmk_hid_keyboard_report_body),
-              CONFIG_ZMK_BLE_KEYBOARD_REPORT_QUEUE_SIZE, 4);
+// A queue of reports waiting to be notified. A new report replaces the last queued one when the
+// host would not miss a transition by skipping the latter, see zmk_hid_report_can_coalesce().
+struct report_queue {
+    struct k_condvar space;
+    const struct bt_gatt_attr *attr;
+    uint8_t *reports;
+    // order in which the queued reports were last changed, across all queues
+    uint32_t *seqs;
+    // the report most recently taken off the queue
+    uint8_t *last_taken;
+    size_t report_len;
+    // number of leading bytes holding modifiers
+    size_t mods_len;
+    size_t capacity;
+    size_t head;
+    size_t len;
+    // the report at the head is being notified and must not be changed
+    bool head_busy;
+    uint32_t coalesced;
+    uint32_t dropped;
+};
+
+#define REPORT_QUEUE_DEFINE(name, type, size, mods_size, attr_index)                               \
+    static uint8_t name##_reports[size][sizeof(type)];                                             \
+    static uint32_t name##_seqs[size];                                                             \
+    static uint8_t name##_last_taken[sizeof(type)];                                                \
+    static struct report_queue name = {                                                            \
+        .attr = &hog_svc.attrs[attr_index],                                                        \
+        .reports = &name##_reports[0][0],                                                          \
+        .seqs = name##_seqs,                                                                       \
+        .last_taken = name##_last_taken,                                                           \
+        .report_len = sizeof(type),                                                                \
+        .mods_len = mods_size,                                                                     \
+        .capacity = size,                                                                          \
+    }
+
+#define REPORT_MAX_LEN                                                                             \
+    MAX(sizeof(struct zmk_hid_keyboard_report_body), sizeof(struct zmk_hid_consumer_report_body))
+
+REPORT_QUEUE_DEFINE(keyboard_queue, struct zmk_hid_keyboard_report_body,
+                    CONFIG_ZMK_BLE_KEYBOARD_REPORT_QUEUE_SIZE, sizeof(zmk_mod_flags_t), 5);
+REPORT_QUEUE_DEFINE(consumer_queue, struct zmk_hid_consumer_report_body,
+                    CONFIG_ZMK_BLE_CONSUMER_REPORT_QUEUE_SIZE, 0, 10);
+
+// All report types are sent by one work item, oldest change first, so reports raised together
+// (e.g. the modifiers and the key of a consumer key with implicit modifiers) are notified back to
+// back and can share a connection event, or a single multiple handle value notification when
+// CONFIG_BT_GATT_NOTIFY_MULTIPLE is enabled and supported by the host.
+static struct report_queue *const report_queues[] = {&keyboard_queue, &consumer_queue};
 
-void send_keyboard_report_callback(struct k_work *work) {
-    struct zmk_hid_keyboard_report_body report;
+static K_MUTEX_DEFINE(report_queues_lock);
+static uint32_t next_seq;
 
-    while (k_msgq_get(&zmk_hog_keyboard_msgq, &report, K_NO_WAIT) == 0) {
-        struct bt_conn *conn = destination_connection();
-        if (conn == NULL) {
-            return;
+static void send_queued_reports(struct k_work *work);
+
+static K_WORK_DEFINE(send_queued_reports_work, send_queued_reports);
+
+static size_t queue_slot(const struct report_queue *queue, size_t index) {
+    return (queue->head + index) % queue->capacity;
+}
+
+static uint8_t *queued_report(struct report_queue *queue, size_t index) {
+    return queue->reports + queue_slot(queue, index) * queue->report_len;
+}
+
+static int report_queue_put(struct report_queue *queue, const uint8_t *report) {
+    k_mutex_lock(&report_queues_lock, K_FOREVER);
+
+    // Only the most recently queued report of any type can be replaced, otherwise the change would
+    // jump ahead of or behind reports of other types queued in between.
+    if (queue->len > 0 && !(queue->len == 1 && queue->head_busy) &&
+        queue->seqs[queue_slot(queue, queue->len - 1)] == next_seq - 1) {
+        uint8_t *last = queued_report(queue, queue->len - 1);
+        const uint8_t *prev =
+            queue->len > 1 ? queued_report(queue, queue->len - 2) : queue->last_taken;
+
+        if (zmk_hid_report_can_coalesce(prev, last, report, queue->report_len,
+                                        queue->mods_len)) {
+            memcpy(last, report, queue->report_len);
+            queue->coalesced++;
+            k_mutex_unlock(&report_queues_lock);
+            return 0;
         }
+    }
 
-        struct bt_gatt_notify_params notify_params = {
-            .attr = &hog_svc.attrs[5],
-            .data = &report,
-            .len = sizeof(report),
-        };
+    if (queue->len == queue->capacity) {
+        k_condvar_wait(&queue->space, &report_queues_lock, K_MSEC(100));
+    }
 
-        int err = bt_gatt_notify_cb(conn, &notify_params);
-        if (err) {
-            LOG_ERR("Error notifying %d", err);
+    if (queue->len == queue->capacity) {
+        // Last resort: drop the oldest report that isn't being notified, so at least the newest
+        // state reaches the host.
+        if (queue->head_busy) {
+            if (queue->len < 2) {
+                k_mutex_unlock(&report_queues_lock);
+                return -ENOMEM;
+            }
+
+            memcpy(queued_report(queue, 1), queued_report(queue, 0), queue->report_len);
+            queue->seqs[queue_slot(queue, 1)] = queue->seqs[queue_slot(queue, 0)];
         }
 
-        bt_conn_unref(conn);
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->len--;
+        queue->dropped++;
+        LOG_WRN("HID report queue full, dropped the oldest report (%d dropped so far)",
+                queue->dropped);
     }
+
+    memcpy(queued_report(queue, queue->len), report, queue->report_len);
+    queue->seqs[queue_slot(queue, queue->len)] = next_seq++;
+    queue->len++;
+
+    k_mutex_unlock(&report_queues_lock);
+
+    k_work_submit_to_queue(&hog_work_q, &send_queued_reports_work);
+
+    return 0;
 }
 
-K_WORK_DEFINE(hog_keyboard_work, send_keyboard_report_callback);
+static bool has_queued_reports() {
+    for (int i = 0; i < ARRAY_SIZE(report_queues); i++) {
+        if (report_queues[i]->len > 0) {
+            return true;
+        }
+    }
 
-int zmk_hog_send_keyboard_report(struct zmk_hid_keyboard_report_body *report) {
-    int err = k_msgq_put(&zmk_hog_keyboard_msgq, report, K_MSEC(100));
-    if (err) {
-        switch (err) {
-        case -EAGAIN: {
-            LOG_WRN("Keyboard message queue full, popping first message and queueing again");
-            struct zmk_hid_keyboard_report_body discarded_report;
-            k_msgq_get(&zmk_hog_keyboard_msgq, &discarded_report, K_NO_WAIT);
-            return zmk_hog_send_keyboard_report(report);
+    return false;
+}
+
+static void notify_sent_cb(struct bt_conn *conn, void *user_data) {
+    // a notification buffer was freed, so anything left queued can go out now
+    if (has_queued_reports()) {
+        k_work_submit_to_queue(&hog_work_q, &send_queued_reports_work);
+    }
+}
+
+// Must be called with report_queues_lock held.
+static struct report_queue *oldest_queued_report() {
+    struct report_queue *oldest = NULL;
+
+    for (int i = 0; i < ARRAY_SIZE(report_queues); i++) {
+        struct report_queue *queue = report_queues[i];
+        if (queue->len == 0) {
+            continue;
         }
-        default:
-            LOG_WRN("Failed to queue keyboard report to send (%d)", err);
-            return err;
+
+        if (oldest == NULL || (int32_t)(queue->seqs[queue_slot(queue, 0)] -
+                                        oldest->seqs[queue_slot(oldest, 0)]) < 0) {
+            oldest = queue;
         }
     }
 
-    k_work_submit_to_queue(&hog_work_q, &hog_keyboard_work);
-
-    return 0;
-};
+    return oldest;
+}
 
-K_MSGQ_DEFINE(zmk_hog_consumer_msgq, sizeof(struct zmk_hid_consumer_report_body),
-              CONFIG_ZMK_BLE_CONSUMER_REPORT_QUEUE_SIZE, 4);
+// Notifies everything queued back to back, so all of it can go out in the next connection event.
+// When the stack runs out of buffers, the rest stays queued until a notification completes.
+static void send_queued_reports(struct k_work *work) {
+    uint8_t report[REPORT_MAX_LEN];
 
-void send_consumer_report_callback(struct k_work *work) {
-    struct zmk_hid_consumer_report_body report;
+    struct bt_conn *conn = destination_connection();
+    if (conn == NULL) {
+        return;
+    }
 
-    while (k_msgq_get(&zmk_hog_consumer_msgq, &report, K_NO_WAIT) == 0) {
-        struct bt_conn *conn = destination_connection();
-        if (conn == NULL) {
-            return;
+    while (true) {
+        k_mutex_lock(&report_queues_lock, K_FOREVER);
+        struct report_queue *queue = oldest_queued_report();
+        if (queue == NULL) {
+            k_mutex_unlock(&report_queues_lock);
+            break;
         }
 
+        memcpy(report, queued_report(queue, 0), queue->report_len);
+        queue->head_busy = true;
+        k_mutex_unlock(&report_queues_lock);
+
         struct bt_gatt_notify_params notify_params = {
-            .attr = &hog_svc.attrs[10],
-            .data = &report,
-            .len = sizeof(report),
+            .attr = queue->attr,
+            .data = report,
+            .len = queue->report_len,
+            .func = notify_sent_cb,
         };
 
         int err = bt_gatt_notify_cb(conn, &notify_params);
-        if (err) {
-            LOG_DBG("Error notifying %d", err);
-        }
-
-        bt_conn_unref(conn);
-    }
-};
 
-K_WORK_DEFINE(hog_consumer_work, send_consumer_report_callback);
+        k_mutex_lock(&report_queues_lock, K_FOREVER);
+        queue->head_busy = false;
 
-int zmk_hog_send_consumer_report(struct zmk_hid_consumer_report_body *report) {
-    int err = k_msgq_put(&zmk_hog_consumer_msgq, report, K_MSEC(100));
-    if (err) {
-        switch (err) {
-        case -EAGAIN: {
-            LOG_WRN("Consumer message queue full, popping first message and queueing again");
-            struct zmk_hid_consumer_report_body discarded_report;
-            k_msgq_get(&zmk_hog_consumer_msgq, &discarded_report, K_NO_WAIT);
-            return zmk_hog_send_consumer_report(report);
-        }
-        default:
-            LOG_WRN("Failed to queue consumer report to send (%d)", err);
-            return err;
+        if (err == -ENOMEM) {
+            k_mutex_unlock(&report_queues_lock);
+            break;
+        } else if (err) {
+            LOG_ERR("Error notifying %d", err);
         }
+
+        memcpy(queue->last_taken, report, queue->report_len);
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->len--;
+        k_condvar_signal(&queue->space);
+        k_mutex_unlock(&report_queues_lock);
     }
 
-    k_work_submit_to_queue(&hog_work_q, &hog_consumer_work);
+    bt_conn_unref(conn);
+}
+
+int zmk_hog_send_keyboard_report(struct zmk_hid_keyboard_report_body *report) {
+    return report_queue_put(&keyboard_queue, (const uint8_t *)report);
+};
 
-    return 0;
+int zmk_hog_send_consumer_report(struct zmk_hid_consumer_report_body *report) {
+    return report_queue_put(&consumer_queue, (const uint8_t *)report);
 };
 
 int zmk_hog_init(const struct device *_arg) {
+    for (int i = 0; i < ARRAY_SIZE(report_queues); i++) {
+        k_condvar_init(&report_queues[i]->space);
+    }
+
     static const struct k_work_queue_config queue_config = {.name = "HID Over GATT Send Work"};
     k_work_queue_start(&hog_work_q, hog_q_stack, K_THREAD_STACK_SIZEOF(hog_q_stack),
                        CONFIG_ZMK_BLE_THREAD_PRIORITY, &queue_config);
@@ -24,15 +24,14 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 #include <zmk/events/position_state_changed.h>
 #include <zmk/events/layer_state_changed.h>
 #include <zmk/events/sensor_event.h>
+#include <zmk/latency.h>
 
-static zmk_keymap_layers_state_t _zmk_keymap_layer_state = 0;
+static zmk_keymap_layers_state_t _zmk_keymap_layer_state;
 static uint8_t _zmk_keymap_layer_default = 0;
 
 #define DT_DRV_COMPAT zmk_keymap
 
-#define LAYER_CHILD_LEN(node) 1 +
 #define ZMK_KEYMAP_NODE DT_DRV_INST(0)
-#define ZMK_KEYMAP_LAYERS_LEN (DT_INST_FOREACH_CHILD(0, LAYER_CHILD_LEN) 0)
 
 #define BINDING_WITH_COMMA(idx, drv_inst) ZMK_KEYMAP_EXTRACT_BINDING(idx, drv_inst),
 
@@ -64,7 +63,15 @@ static uint8_t _zmk_keymap_layer_default = 0;
 // When a behavior handles a key position "down" event, we record the layer state
 // here so that even if that layer is deactivated before the "up", event, we
 // still send the release event to the behavior in that layer also.
-static uint32_t zmk_keymap_active_behavior_layer[ZMK_KEYMAP_LEN];
+static zmk_keymap_layers_state_t zmk_keymap_active_behavior_layer[ZMK_KEYMAP_LEN];
+
+// For each position, the highest active layer whose binding isn't `&trans`, which is where
+// resolving a key event starts. Kept up to date as layers are activated and deactivated.
+static uint8_t zmk_keymap_effective_layer[ZMK_KEYMAP_LEN];
+
+// The effective layer at the time the position was pressed, used together with
+// zmk_keymap_active_behavior_layer to resolve the release the same way as the press.
+static uint8_t zmk_keymap_active_behavior_start[ZMK_KEYMAP_LEN];
 
 static struct zmk_behavior_binding zmk_keymap[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN] = {
     DT_INST_FOREACH_CHILD(0, TRANSFORMED_LAYER)};
@@ -80,6 +87,41 @@ static struct zmk_behavior_binding zmk_sensor_keymap[ZMK_KEYMAP_LAYERS_LEN]
 
 #endif /* ZMK_KEYMAP_HAS_SENSORS */
 
+static bool is_transparent_binding(uint8_t layer, uint32_t position) {
+#if DT_HAS_COMPAT_STATUS_OKAY(zmk_behavior_transparent)
+    return zmk_keymap[layer][position].behavior ==
+           DEVICE_DT_GET(DT_INST(0, zmk_behavior_transparent));
+#else
+    return false;
+#endif
+}
+
+static uint8_t find_effective_layer(uint32_t position, int from_layer) {
+    const zmk_keymap_layers_state_t *state = &_zmk_keymap_layer_state;
+
+    for (int layer = zmk_keymap_layers_state_highest_below(state, from_layer + 1);
+         layer > _zmk_keymap_layer_default;
+         layer = zmk_keymap_layers_state_highest_below(state, layer)) {
+        if (!is_transparent_binding(layer, position)) {
+            return layer;
+        }
+    }
+
+    return _zmk_keymap_layer_default;
+}
+
+static void update_effective_layers(uint8_t layer, bool state) {
+    for (int position = 0; position < ZMK_KEYMAP_LEN; position++) {
+        uint8_t effective = zmk_keymap_effective_layer[position];
+
+        if (state && layer > effective && !is_transparent_binding(layer, position)) {
+            zmk_keymap_effective_layer[position] = layer;
+        } else if (!state && layer == effective) {
+            zmk_keymap_effective_layer[position] = find_effective_layer(position, layer - 1);
+        }
+    }
+}
+
 static inline int set_layer_state(uint8_t layer, bool state) {
     if (layer >= ZMK_KEYMAP_LAYERS_LEN) {
         return -EINVAL;
@@ -90,14 +132,16 @@ static inline int set_layer_state(uint8_t layer, bool state) {
         return 0;
     }
 
-    zmk_keymap_layers_state_t old_state = _zmk_keymap_layer_state;
-    WRITE_BIT(_zmk_keymap_layer_state, layer, state);
     // Don't send state changes unless there was an actual change
-    if (old_state != _zmk_keymap_layer_state) {
-        LOG_DBG("layer_changed: layer %d state %d", layer, state);
-        ZMK_EVENT_RAISE(create_layer_state_changed(layer, state));
+    if (zmk_keymap_layers_state_test(&_zmk_keymap_layer_state, layer) == state) {
+        return 0;
     }
 
+    zmk_keymap_layers_state_write(&_zmk_keymap_layer_state, layer, state);
+    update_effective_layers(layer, state);
+    LOG_DBG("layer_changed: layer %d state %d", layer, state);
+    ZMK_EVENT_RAISE(create_layer_state_changed(layer, state));
+
     return 0;
 }
 
@@ -105,23 +149,21 @@ uint8_t zmk_keymap_layer_default() { return _zmk_keymap_layer_default; }
 
 zmk_keymap_layers_state_t zmk_keymap_layer_state() { return _zmk_keymap_layer_state; }
 
-bool zmk_keymap_layer_active_with_state(uint8_t layer, zmk_keymap_layers_state_t state_to_test) {
+bool zmk_keymap_layer_active_with_state(uint8_t layer,
+                                        const zmk_keymap_layers_state_t *state_to_test) {
     // The default layer is assumed to be ALWAYS ACTIVE so we include an || here to ensure nobody
     // breaks up that assumption by accident
-    return (state_to_test & (BIT(layer))) == (BIT(layer)) || layer == _zmk_keymap_layer_default;
+    return zmk_keymap_layers_state_test(state_to_test, layer) ||
+           layer == _zmk_keymap_layer_default;
 };
 
 bool zmk_keymap_layer_active(uint8_t layer) {
-    return zmk_keymap_layer_active_with_state(layer, _zmk_keymap_layer_state);
+    return zmk_keymap_layer_active_with_state(layer, &_zmk_keymap_layer_state);
 };
 
 uint8_t zmk_keymap_highest_layer_active() {
-    for (uint8_t layer = ZMK_KEYMAP_LAYERS_LEN - 1; layer > 0; layer--) {
-        if (zmk_keymap_layer_active(layer)) {
-            return layer;
-        }
-    }
-    return zmk_keymap_layer_default();
+    return MAX(zmk_keymap_layers_state_highest(&_zmk_keymap_layer_state),
+               _zmk_keymap_layer_default);
 }
 
 int zmk_keymap_layer_activate(uint8_t layer) { return set_layer_state(layer, true); };
@@ -137,7 +179,10 @@ int zmk_keymap_layer_toggle(uint8_t layer) {
 };
 
 int zmk_keymap_layer_to(uint8_t layer) {
-    for (int i = ZMK_KEYMAP_LAYERS_LEN - 1; i >= 0; i--) {
+    // Only visit layers that are actually active, from the top down. The next one is looked up
+    // from the live state, since layer listeners may (de)activate other layers in between.
+    for (int i = zmk_keymap_layers_state_highest(&_zmk_keymap_layer_state); i >= 0;
+         i = zmk_keymap_layers_state_highest_below(&_zmk_keymap_layer_state, i)) {
         zmk_keymap_layer_deactivate(i);
     }
 
@@ -146,8 +191,8 @@ int zmk_keymap_layer_to(uint8_t layer) {
     return 0;
 }
 
-bool is_active_layer(uint8_t layer, zmk_keymap_layers_state_t layer_state) {
-    return (layer_state & BIT(layer)) == BIT(layer) || layer == _zmk_keymap_layer_default;
+bool is_active_layer(uint8_t layer, const zmk_keymap_layers_state_t *layer_state) {
+    return zmk_keymap_layers_state_test(layer_state, layer) || layer == _zmk_keymap_layer_default;
 }
 
 const char *zmk_keymap_layer_label(uint8_t layer) {
@@ -167,12 +212,20 @@ int invoke_locally(struct zmk_behavior_binding *binding, struct zmk_behavior_bin
     }
 }
 
+static const struct device *resolve_binding_device(struct zmk_behavior_binding *binding) {
+    if (binding->behavior == NULL) {
+        binding->behavior = device_get_binding(binding->behavior_dev);
+    }
+
+    return binding->behavior;
+}
+
 int zmk_keymap_apply_position_state(uint8_t source, int layer, uint32_t position, bool pressed,
                                     int64_t timestamp) {
+    const struct device *behavior = resolve_binding_device(&zmk_keymap[layer][position]);
     // We want to make a copy of this, since it may be converted from
     // relative to absolute before being invoked
     struct zmk_behavior_binding binding = zmk_keymap[layer][position];
-    const struct device *behavior;
     struct zmk_behavior_binding_event event = {
         .layer = layer,
         .position = position,
@@ -182,8 +235,6 @@ int zmk_keymap_apply_position_state(uint8_t source, int layer, uint32_t position
     LOG_DBG("layer: %d position: %d, binding name: %s", layer, position,
             log_strdup(binding.behavior_dev));
 
-    behavior = device_get_binding(binding.behavior_dev);
-
     if (!behavior) {
         LOG_WRN("No behavior assigned to %d on layer %d", position, layer);
         return 1;
@@ -231,9 +282,14 @@ int zmk_keymap_position_state_changed(uint8_t source, uint32_t position, bool pr
                                       int64_t timestamp) {
     if (pressed) {
         zmk_keymap_active_behavior_layer[position] = _zmk_keymap_layer_state;
+        zmk_keymap_active_behavior_start[position] = zmk_keymap_effective_layer[position];
     }
-    for (int layer = ZMK_KEYMAP_LAYERS_LEN - 1; layer >= _zmk_keymap_layer_default; layer--) {
-        if (zmk_keymap_layer_active_with_state(layer, zmk_keymap_active_behavior_layer[position])) {
+    // Layers above the start layer were either inactive or `&trans` when the position was
+    // pressed, so skipping them resolves to the same binding as checking each one.
+    for (int layer = zmk_keymap_active_behavior_start[position];
+         layer >= _zmk_keymap_layer_default; layer--) {
+        if (zmk_keymap_layer_active_with_state(layer,
+                                               &zmk_keymap_active_behavior_layer[position])) {
             int ret = zmk_keymap_apply_position_state(source, layer, position, pressed, timestamp);
             if (ret > 0) {
                 LOG_DBG("behavior processing to continue to next layer");
@@ -262,7 +318,7 @@ int zmk_keymap_sensor_triggered(uint8_t sensor_number, const struct device *sens
             LOG_DBG("layer: %d sensor_number: %d, binding name: %s", layer, sensor_number,
                     log_strdup(binding->behavior_dev));
 
-            behavior = device_get_binding(binding->behavior_dev);
+            behavior = resolve_binding_device(binding);
 
             if (!behavior) {
                 LOG_DBG("No behavior assigned to %d on layer %d", sensor_number, layer);
@@ -291,6 +347,7 @@ int zmk_keymap_sensor_triggered(uint8_t sensor_number, const struct device *sens
 int keymap_listener(const zmk_event_t *eh) {
     const struct zmk_position_state_changed *pos_ev;
     if ((pos_ev = as_zmk_position_state_changed(eh)) != NULL) {
+        zmk_latency_stamp(ZMK_LATENCY_STAGE_POSITION);
         return zmk_keymap_position_state_changed(pos_ev->source, pos_ev->position, pos_ev->state,
                                                  pos_ev->timestamp);
     }
@@ -306,6 +363,32 @@ int keymap_listener(const zmk_event_t *eh) {
     return -ENOTSUP;
 }
 
+static int zmk_keymap_init(const struct device *_arg) {
+    // Resolve behavior devices up front so key events don't pay for label lookups. Any that
+    // aren't ready yet are resolved on first use instead.
+    for (int layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        for (int position = 0; position < ZMK_KEYMAP_LEN; position++) {
+            resolve_binding_device(&zmk_keymap[layer][position]);
+        }
+
+#if ZMK_KEYMAP_HAS_SENSORS
+        for (int sensor = 0; sensor < ZMK_KEYMAP_SENSORS_LEN; sensor++) {
+            resolve_binding_device(&zmk_sensor_keymap[layer][sensor]);
+        }
+#endif /* ZMK_KEYMAP_HAS_SENSORS */
+    }
+
+    // Transparent bindings can only be skipped once their devices are resolved
+    for (int position = 0; position < ZMK_KEYMAP_LEN; position++) {
+        zmk_keymap_effective_layer[position] =
+            find_effective_layer(position, ZMK_KEYMAP_LAYERS_LEN - 1);
+    }
+
+    return 0;
+}
+
+SYS_INIT(zmk_keymap_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
 ZMK_LISTENER(keymap, keymap_listener);
 ZMK_SUBSCRIPTION(keymap, zmk_position_state_changed);
 
@@ -12,9 +12,13 @@
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
+#include <zmk/endpoints.h>
+#include <zmk/kscan.h>
 #include <zmk/matrix_transform.h>
 #include <zmk/event_manager.h>
 #include <zmk/events/position_state_changed.h>
+#include <zmk/latency.h>
+#include <zmk/workqueue.h>
 
 #define ZMK_KSCAN_EVENT_STATE_PRESSED 0
 #define ZMK_KSCAN_EVENT_STATE_RELEASED 1
@@ -23,39 +27,61 @@ struct zmk_kscan_event {
     uint32_t row;
     uint32_t column;
     uint32_t state;
+    // uptime in ticks when the driver reported the event, i.e. during the scan that detected it
+    int64_t scan_time;
+    uint32_t timestamp;
 };
 
 struct zmk_kscan_msg_processor {
-    struct k_work work;
+    struct k_work_delayable work;
 } msg_processor;
 
 K_MSGQ_DEFINE(zmk_kscan_msgq, sizeof(struct zmk_kscan_event), CONFIG_ZMK_KSCAN_EVENT_QUEUE_SIZE, 4);
 
+static atomic_t dropped_events;
+
 static void zmk_kscan_callback(const struct device *dev, uint32_t row, uint32_t column,
                                bool pressed) {
     struct zmk_kscan_event ev = {
         .row = row,
         .column = column,
-        .state = (pressed ? ZMK_KSCAN_EVENT_STATE_PRESSED : ZMK_KSCAN_EVENT_STATE_RELEASED)};
+        .state = (pressed ? ZMK_KSCAN_EVENT_STATE_PRESSED : ZMK_KSCAN_EVENT_STATE_RELEASED),
+        .scan_time = k_uptime_ticks(),
+        .timestamp = zmk_latency_timestamp()};
 
-    k_msgq_put(&zmk_kscan_msgq, &ev, K_NO_WAIT);
-    k_work_submit(&msg_processor.work);
+    if (k_msgq_put(&zmk_kscan_msgq, &ev, K_NO_WAIT) != 0) {
+        LOG_WRN("Kscan event queue full, dropped row %d col %d (%d dropped). Increase "
+                "CONFIG_ZMK_KSCAN_EVENT_QUEUE_SIZE",
+                row, column, (int)atomic_inc(&dropped_events) + 1);
+    }
+    k_work_schedule_for_queue(zmk_workqueue_input_work_q(), &msg_processor.work,
+                              K_MSEC(CONFIG_ZMK_KSCAN_EVENT_PROCESSING_DELAY_MS));
 }
 
+uint32_t zmk_kscan_dropped_events(void) { return (uint32_t)atomic_get(&dropped_events); }
+
 void zmk_kscan_process_msgq(struct k_work *item) {
     struct zmk_kscan_event ev;
 
+    // all events queued by the last scan are sent to the host together
+    zmk_endpoints_batch_begin();
     while (k_msgq_get(&zmk_kscan_msgq, &ev, K_NO_WAIT) == 0) {
+        zmk_latency_key_begin(ev.timestamp);
         bool pressed = (ev.state == ZMK_KSCAN_EVENT_STATE_PRESSED);
         uint32_t position = zmk_matrix_transform_row_column_to_position(ev.row, ev.column);
         LOG_DBG("Row: %d, col: %d, position: %d, pressed: %s", ev.row, ev.column, position,
                 (pressed ? "true" : "false"));
-        ZMK_EVENT_RAISE(new_zmk_position_state_changed(
-            (struct zmk_position_state_changed){.source = ZMK_POSITION_STATE_CHANGE_SOURCE_LOCAL,
-                                                .state = pressed,
-                                                .position = position,
-                                                .timestamp = k_uptime_get()}));
+        // Stamp the event with the time of the scan rather than now, so decisions based on timing
+        // are not skewed by how long the event waited in the queue.
+        ZMK_EVENT_RAISE(new_zmk_position_state_changed((struct zmk_position_state_changed){
+            .source = ZMK_POSITION_STATE_CHANGE_SOURCE_LOCAL,
+            .state = pressed,
+            .position = position,
+            .timestamp = k_ticks_to_ms_floor64(ev.scan_time)}));
+        zmk_latency_key_end();
     }
+    zmk_endpoints_batch_end();
+    zmk_latency_keys_done();
 }
 
 int zmk_kscan_init(char *name) {
@@ -65,10 +91,23 @@ int zmk_kscan_init(char *name) {
         return -EINVAL;
     }
 
-    k_work_init(&msg_processor.work, zmk_kscan_process_msgq);
+    k_work_init_delayable(&msg_processor.work, zmk_kscan_process_msgq);
 
     kscan_config(dev, zmk_kscan_callback);
     kscan_enable_callback(dev);
 
     return 0;
 }
+
+#if IS_ENABLED(CONFIG_ARCH_POSIX)
+#include <soc.h>
+
+static void log_dropped_events_on_exit(void) {
+    if (atomic_get(&dropped_events) > 0) {
+        LOG_PANIC();
+        LOG_WRN("%d kscan events were dropped", (int)atomic_get(&dropped_events));
+    }
+}
+
+NATIVE_TASK(log_dropped_events_on_exit, ON_EXIT, 1);
+#endif
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <zephyr.h>
+#include <init.h>
+#include <logging/log.h>
+
+LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+#include <zmk/keymap.h>
+#include <zmk/latency.h>
+#include <zmk/workqueue.h>
+
+#if IS_ENABLED(CONFIG_ARCH_POSIX)
+// Simulated time does not advance while code runs on native_posix, so use the host clock.
+#include <soc.h>
+#include <native_rtc.h>
+#endif
+
+#define SAMPLES_LEN CONFIG_ZMK_LATENCY_BENCHMARK_SAMPLES
+
+struct latency_stage_samples {
+    uint32_t samples[SAMPLES_LEN];
+    uint32_t count;
+    uint32_t max;
+};
+
+static const char *stage_names[ZMK_LATENCY_STAGE_COUNT] = {
+    [ZMK_LATENCY_STAGE_KSCAN] = "kscan",
+    [ZMK_LATENCY_STAGE_POSITION] = "position_state_changed",
+    [ZMK_LATENCY_STAGE_KEYCODE] = "keycode_state_changed",
+    [ZMK_LATENCY_STAGE_REPORT] = "send_report",
+    [ZMK_LATENCY_STAGE_MATRIX_SCAN] = "matrix_scan",
+    [ZMK_LATENCY_STAGE_DISPATCH] = "dispatch",
+    [ZMK_LATENCY_STAGE_HIGHEST_LAYER] = "highest_layer",
+};
+
+static struct latency_stage_samples stages[ZMK_LATENCY_STAGE_COUNT];
+static uint32_t sorted_samples[SAMPLES_LEN];
+
+// Stamps are measured from the key that caused them, so only while a batch of scanned keys is
+// being processed. Anything later was raised from a timer and can't be attributed to a key.
+static bool key_active;
+static bool batch_active;
+static uint32_t current_kscan_timestamp;
+static uint32_t batch_kscan_timestamp;
+static uint32_t skipped_stamps;
+static uint32_t current_key_started_at;
+static uint32_t keys_processed;
+static uint64_t key_processing_total;
+static uint32_t key_processing_max;
+
+uint32_t zmk_latency_timestamp(void) {
+#if IS_ENABLED(CONFIG_ARCH_POSIX)
+    return (uint32_t)native_rtc_gettime_us(RTC_CLOCK_REAL);
+#else
+    return k_cycle_get_32();
+#endif
+}
+
+static uint32_t to_us(uint32_t duration) {
+#if IS_ENABLED(CONFIG_ARCH_POSIX)
+    return duration;
+#else
+    return k_cyc_to_us_floor32(duration);
+#endif
+}
+
+static void add_sample(struct latency_stage_samples *stage, uint32_t duration) {
+    stage->samples[stage->count % SAMPLES_LEN] = duration;
+    stage->count++;
+    stage->max = MAX(stage->max, duration);
+}
+
+void zmk_latency_key_begin(uint32_t kscan_timestamp) {
+    if (!batch_active) {
+        batch_active = true;
+        batch_kscan_timestamp = kscan_timestamp;
+    }
+    key_active = true;
+    current_kscan_timestamp = kscan_timestamp;
+    current_key_started_at = zmk_latency_timestamp();
+    add_sample(&stages[ZMK_LATENCY_STAGE_KSCAN], current_key_started_at - kscan_timestamp);
+}
+
+void zmk_latency_key_end(void) {
+    key_active = false;
+    uint32_t duration = zmk_latency_timestamp() - current_key_started_at;
+    keys_processed++;
+    key_processing_total += duration;
+    key_processing_max = MAX(key_processing_max, duration);
+}
+
+void zmk_latency_keys_done(void) { batch_active = false; }
+
+void zmk_latency_stamp(enum zmk_latency_stage stage) {
+    if (key_active) {
+        add_sample(&stages[stage], zmk_latency_timestamp() - current_kscan_timestamp);
+    } else if (batch_active) {
+        // e.g. a report held back until every key of the scan was processed
+        add_sample(&stages[stage], zmk_latency_timestamp() - batch_kscan_timestamp);
+    } else {
+        skipped_stamps++;
+    }
+}
+
+void zmk_latency_record(enum zmk_latency_stage stage, uint32_t duration) {
+    add_sample(&stages[stage], duration);
+}
+
+static uint32_t stage_to_us(enum zmk_latency_stage stage, uint32_t duration) {
+    // Dispatch delays are measured in kernel uptime, which includes simulated busy waits on
+    // native_posix, and are already recorded in microseconds.
+    return stage == ZMK_LATENCY_STAGE_DISPATCH ? duration : to_us(duration);
+}
+
+static uint32_t percentile(uint32_t len, uint32_t percent) {
+    return sorted_samples[(len - 1) * percent / 100];
+}
+
+static void sort_samples(const struct latency_stage_samples *stage, uint32_t len) {
+    // insertion sort, this only runs when the report is printed.
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t sample = stage->samples[i];
+        uint32_t j = i;
+        for (; j > 0 && sorted_samples[j - 1] > sample; j--) {
+            sorted_samples[j] = sorted_samples[j - 1];
+        }
+        sorted_samples[j] = sample;
+    }
+}
+
+void zmk_latency_log_report(void) {
+    for (int i = 0; i < ZMK_LATENCY_STAGE_COUNT; i++) {
+        const struct latency_stage_samples *stage = &stages[i];
+        uint32_t len = MIN(stage->count, SAMPLES_LEN);
+        if (len == 0) {
+            LOG_INF("latency %s: no samples", stage_names[i]);
+            continue;
+        }
+
+        sort_samples(stage, len);
+        LOG_INF("latency %s: %u samples, p50 %u us, p99 %u us, max %u us", stage_names[i],
+                stage->count, stage_to_us(i, percentile(len, 50)),
+                stage_to_us(i, percentile(len, 99)), stage_to_us(i, stage->max));
+    }
+
+    if (skipped_stamps > 0) {
+        LOG_INF("latency skipped: %u stamps raised from timers", skipped_stamps);
+    }
+
+    if (keys_processed > 0) {
+        LOG_INF("latency processing: %u keys, %u us per key, max %u us", keys_processed,
+                to_us((uint32_t)(key_processing_total / keys_processed)),
+                to_us(key_processing_max));
+    }
+}
+
+#if CONFIG_ZMK_LATENCY_BENCHMARK_DISPATCH_PROBE_MS > 0
+
+static int64_t dispatch_probe_expired_at;
+
+static void dispatch_probe_work_cb(struct k_work *work) {
+    add_sample(&stages[ZMK_LATENCY_STAGE_DISPATCH],
+               k_ticks_to_us_floor32(k_uptime_ticks() - dispatch_probe_expired_at));
+}
+
+K_WORK_DEFINE(dispatch_probe_work, dispatch_probe_work_cb);
+
+static void dispatch_probe_timer_cb(struct k_timer *timer) {
+    dispatch_probe_expired_at = k_uptime_ticks();
+    k_work_submit_to_queue(zmk_workqueue_input_work_q(), &dispatch_probe_work);
+}
+
+K_TIMER_DEFINE(dispatch_probe_timer, dispatch_probe_timer_cb, NULL);
+
+#endif
+
+#if CONFIG_ZMK_LATENCY_BENCHMARK_LAYER_QUERY_PROBE_MS > 0
+
+// Keeps the compiler from dropping the lookups.
+static volatile uint8_t layer_query_sink;
+
+// Only the default layer is active, so a lookup that scans down from the top layer would visit
+// every layer of the keymap.
+static void layer_query_probe_work_cb(struct k_work *work) {
+    uint32_t start = zmk_latency_timestamp();
+
+    for (int i = 0; i < ZMK_LATENCY_LAYER_QUERIES; i++) {
+        layer_query_sink += zmk_keymap_highest_layer_active();
+    }
+
+    add_sample(&stages[ZMK_LATENCY_STAGE_HIGHEST_LAYER], zmk_latency_timestamp() - start);
+}
+
+K_WORK_DEFINE(layer_query_probe_work, layer_query_probe_work_cb);
+
+static void layer_query_probe_timer_cb(struct k_timer *timer) {
+    k_work_submit_to_queue(zmk_workqueue_input_work_q(), &layer_query_probe_work);
+}
+
+K_TIMER_DEFINE(layer_query_probe_timer, layer_query_probe_timer_cb, NULL);
+
+#endif
+
+#if CONFIG_ZMK_LATENCY_BENCHMARK_BACKGROUND_LOAD_US > 0
+
+// Stands in for RGB underglow ticks, display refreshes and settings saves on the system work queue.
+static void background_load_work_cb(struct k_work *work) {
+    k_busy_wait(CONFIG_ZMK_LATENCY_BENCHMARK_BACKGROUND_LOAD_US);
+}
+
+K_WORK_DEFINE(background_load_work, background_load_work_cb);
+
+static void background_load_timer_cb(struct k_timer *timer) {
+    k_work_submit(&background_load_work);
+}
+
+K_TIMER_DEFINE(background_load_timer, background_load_timer_cb, NULL);
+
+#endif
+
+static int zmk_latency_init(const struct device *_arg) {
+#if CONFIG_ZMK_LATENCY_BENCHMARK_DISPATCH_PROBE_MS > 0
+    k_timer_start(&dispatch_probe_timer, K_MSEC(CONFIG_ZMK_LATENCY_BENCHMARK_DISPATCH_PROBE_MS),
+                  K_MSEC(CONFIG_ZMK_LATENCY_BENCHMARK_DISPATCH_PROBE_MS));
+#endif
+#if CONFIG_ZMK_LATENCY_BENCHMARK_LAYER_QUERY_PROBE_MS > 0
+    k_timer_start(&layer_query_probe_timer,
+                  K_MSEC(CONFIG_ZMK_LATENCY_BENCHMARK_LAYER_QUERY_PROBE_MS),
+                  K_MSEC(CONFIG_ZMK_LATENCY_BENCHMARK_LAYER_QUERY_PROBE_MS));
+#endif
+#if CONFIG_ZMK_LATENCY_BENCHMARK_BACKGROUND_LOAD_US > 0
+    k_timer_start(&background_load_timer,
+                  K_MSEC(CONFIG_ZMK_LATENCY_BENCHMARK_BACKGROUND_LOAD_PERIOD_MS),
+                  K_MSEC(CONFIG_ZMK_LATENCY_BENCHMARK_BACKGROUND_LOAD_PERIOD_MS));
+#endif
+    return 0;
+}
+
+SYS_INIT(zmk_latency_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#if IS_ENABLED(CONFIG_ARCH_POSIX)
+static void log_report_on_exit(void) {
+    LOG_PANIC();
+    zmk_latency_log_report();
+}
+
+NATIVE_TASK(log_report_on_exit, ON_EXIT, 1);
+#endif
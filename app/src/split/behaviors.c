@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <device.h>
+#include <devicetree.h>
+#include <sys/util.h>
+
+#include <zmk/split/behaviors.h>
+
+#define BEHAVIOR_LABEL(node) DT_PROP_OR(node, label, NULL),
+
+static const char *const behavior_labels[] = {
+#if DT_NODE_EXISTS(DT_PATH(behaviors))
+    DT_FOREACH_CHILD_STATUS_OKAY(DT_PATH(behaviors), BEHAVIOR_LABEL)
+#endif
+#if DT_NODE_EXISTS(DT_PATH(macros))
+    DT_FOREACH_CHILD_STATUS_OKAY(DT_PATH(macros), BEHAVIOR_LABEL)
+#endif
+};
+
+BUILD_ASSERT(ARRAY_SIZE(behavior_labels) <= UINT8_MAX + 1,
+             "Too many behaviors to send them between split halves");
+
+// Looked up all at once on first use, as behavior devices are initialized after most of the split
+// code. Labels without a device stay NULL.
+static const struct device *behaviors[ARRAY_SIZE(behavior_labels)];
+static bool behaviors_resolved;
+
+static void resolve_behaviors() {
+    if (behaviors_resolved) {
+        return;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(behaviors); i++) {
+        if (behavior_labels[i] != NULL) {
+            behaviors[i] = device_get_binding(behavior_labels[i]);
+        }
+    }
+    behaviors_resolved = true;
+}
+
+const struct device *zmk_split_behavior_get(uint8_t index) {
+    if (index >= ARRAY_SIZE(behaviors)) {
+        return NULL;
+    }
+
+    resolve_behaviors();
+    return behaviors[index];
+}
+
+int zmk_split_behavior_index(const struct device *behavior) {
+    if (behavior == NULL) {
+        return -ENODEV;
+    }
+
+    resolve_behaviors();
+    for (int i = 0; i < ARRAY_SIZE(behaviors); i++) {
+        if (behaviors[i] == behavior) {
+            return i;
+        }
+    }
+
+    return -ENODEV;
+}
+
+uint32_t zmk_split_behaviors_hash() {
+    // 32-bit FNV-1a, with each label's terminator hashed too so labels can't run together
+    uint32_t hash = 2166136261U;
+
+    for (int i = 0; i < ARRAY_SIZE(behavior_labels); i++) {
+        const char *label = behavior_labels[i] != NULL ? behavior_labels[i] : "";
+        do {
+            hash = (hash ^ (uint8_t)*label) * 16777619U;
+        } while (*label++ != '\0');
+    }
+
+    return hash;
+}
+
+const char *zmk_split_behavior_label(uint8_t index) {
+    if (index >= ARRAY_SIZE(behavior_labels)) {
+        return NULL;
+    }
+
+    return behavior_labels[index];
+}
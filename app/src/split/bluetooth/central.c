@@ -20,15 +20,23 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 #include <zmk/stdlib.h>
 #include <zmk/ble.h>
 #include <zmk/behavior.h>
+#include <drivers/behavior.h>
+#include <zmk/split/behaviors.h>
 #include <zmk/split/bluetooth/uuid.h>
 #include <zmk/split/bluetooth/service.h>
+#include <zmk/split/bluetooth/position_events.h>
 #include <zmk/event_manager.h>
+#include <zmk/endpoints.h>
 #include <zmk/events/position_state_changed.h>
+#include <zmk/workqueue.h>
 #include <init.h>
 
 static int start_scan(void);
 
-#define POSITION_STATE_DATA_LEN 16
+#define POSITION_STATE_DATA_LEN ZMK_SPLIT_POSITION_STATE_LEN
+
+#define BEHAVIORS_HASH_READ_RETRIES 3
+#define BEHAVIORS_HASH_RETRY_MS 100
 
 enum peripheral_slot_state {
     PERIPHERAL_SLOT_STATE_OPEN,
@@ -42,7 +50,18 @@ struct peripheral_slot {
     struct bt_gatt_discover_params discover_params;
     struct bt_gatt_subscribe_params subscribe_params;
     struct bt_gatt_discover_params sub_discover_params;
+    struct bt_gatt_read_params sync_params;
+    struct bt_gatt_read_params behaviors_hash_params;
+    struct k_work_delayable behaviors_hash_retry_work;
     uint16_t run_behavior_handle;
+    uint16_t position_state_handle;
+    uint16_t position_events_handle;
+    uint16_t behaviors_hash_handle;
+    // behaviors are only invoked by index once the peripheral's table is known to match
+    bool behaviors_match;
+    uint8_t behaviors_hash_retries;
+    struct zmk_split_position_events_receiver position_events;
+    bool position_events_sync_pending;
     uint8_t position_state[POSITION_STATE_DATA_LEN];
     uint8_t changed_positions[POSITION_STATE_DATA_LEN];
 };
@@ -56,14 +75,30 @@ K_MSGQ_DEFINE(peripheral_event_msgq, sizeof(struct zmk_position_state_changed),
 
 void peripheral_event_work_callback(struct k_work *work) {
     struct zmk_position_state_changed ev;
+    // all events from the queued peripheral notifications are sent to the host together
+    zmk_endpoints_batch_begin();
     while (k_msgq_get(&peripheral_event_msgq, &ev, K_NO_WAIT) == 0) {
         LOG_DBG("Trigger key position state change for %d", ev.position);
         ZMK_EVENT_RAISE(new_zmk_position_state_changed(ev));
     }
+    zmk_endpoints_batch_end();
 }
 
 K_WORK_DEFINE(peripheral_event_work, peripheral_event_work_callback);
 
+static void queue_peripheral_event(uint8_t source, uint32_t position, bool pressed,
+                                   int64_t timestamp) {
+    struct zmk_position_state_changed ev = {
+        .source = source, .position = position, .state = pressed, .timestamp = timestamp};
+
+    if (k_msgq_put(&peripheral_event_msgq, &ev, K_NO_WAIT) != 0) {
+        LOG_WRN("Peripheral event queue full, dropped position %d. Increase "
+                "CONFIG_ZMK_SPLIT_BLE_CENTRAL_POSITION_QUEUE_SIZE",
+                position);
+    }
+    k_work_submit_to_queue(zmk_workqueue_input_work_q(), &peripheral_event_work);
+}
+
 int peripheral_slot_index_for_conn(struct bt_conn *conn) {
     for (int i = 0; i < ZMK_BLE_SPLIT_PERIPHERAL_COUNT; i++) {
         if (peripherals[i].conn == conn) {
@@ -106,14 +141,7 @@ int release_peripheral_slot(int index) {
     for (int i = 0; i < POSITION_STATE_DATA_LEN; i++) {
         for (int j = 0; j < 8; j++) {
             if (slot->position_state[i] & BIT(j)) {
-                uint32_t position = (i * 8) + j;
-                struct zmk_position_state_changed ev = {.source = index,
-                                                        .position = position,
-                                                        .state = false,
-                                                        .timestamp = k_uptime_get()};
-
-                k_msgq_put(&peripheral_event_msgq, &ev, K_NO_WAIT);
-                k_work_submit(&peripheral_event_work);
+                queue_peripheral_event(index, (i * 8) + j, false, k_uptime_get());
             }
         }
     }
@@ -126,6 +154,14 @@ int release_peripheral_slot(int index) {
     // Clean up previously discovered handles;
     slot->subscribe_params.value_handle = 0;
     slot->run_behavior_handle = 0;
+    slot->position_state_handle = 0;
+    slot->position_events_handle = 0;
+    slot->behaviors_hash_handle = 0;
+    slot->behaviors_match = false;
+    slot->behaviors_hash_retries = 0;
+    k_work_cancel_delayable(&slot->behaviors_hash_retry_work);
+    slot->position_events_sync_pending = false;
+    zmk_split_position_events_reset(&slot->position_events);
 
     return 0;
 }
@@ -162,6 +198,98 @@ int confirm_peripheral_slot_conn(struct bt_conn *conn) {
     return 0;
 }
 
+static void split_central_update_position_state(struct peripheral_slot *slot, const uint8_t *data,
+                                                int64_t timestamp) {
+    for (int i = 0; i < POSITION_STATE_DATA_LEN; i++) {
+        slot->changed_positions[i] = data[i] ^ slot->position_state[i];
+        slot->position_state[i] = data[i];
+        LOG_DBG("data: %d", slot->position_state[i]);
+    }
+
+    for (int i = 0; i < POSITION_STATE_DATA_LEN; i++) {
+        for (int j = 0; j < 8; j++) {
+            if (slot->changed_positions[i] & BIT(j)) {
+                queue_peripheral_event(slot - peripherals, (i * 8) + j,
+                                       slot->position_state[i] & BIT(j), timestamp);
+            }
+        }
+    }
+}
+
+static uint8_t split_central_position_events_sync_func(struct bt_conn *conn, uint8_t err,
+                                                       struct bt_gatt_read_params *params,
+                                                       const void *data, uint16_t length) {
+    struct peripheral_slot *slot = peripheral_slot_for_conn(conn);
+    if (slot == NULL) {
+        LOG_ERR("No peripheral state found for connection");
+        return BT_GATT_ITER_STOP;
+    }
+
+    slot->position_events_sync_pending = false;
+
+    if (err) {
+        LOG_ERR("Failed to read the position events sync (err %d)", err);
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (!data || length < sizeof(struct zmk_split_position_events_sync)) {
+        LOG_ERR("Invalid position events sync of length %u", length);
+        return BT_GATT_ITER_STOP;
+    }
+
+    const struct zmk_split_position_events_sync *sync = data;
+    LOG_DBG("Synced position events at seq %d", sync->seq);
+    split_central_update_position_state(slot, sync->position_state, k_uptime_get());
+    zmk_split_position_events_synced(&slot->position_events, sync->seq);
+
+    return BT_GATT_ITER_STOP;
+}
+
+static void split_central_sync_position_events(struct bt_conn *conn,
+                                               struct peripheral_slot *slot) {
+    slot->position_events.synced = false;
+    if (slot->position_events_sync_pending) {
+        return;
+    }
+
+    slot->sync_params.func = split_central_position_events_sync_func;
+    slot->sync_params.handle_count = 1;
+    slot->sync_params.single.handle = slot->position_events_handle;
+    slot->sync_params.single.offset = 0;
+
+    int err = bt_gatt_read(conn, &slot->sync_params);
+    if (err) {
+        LOG_ERR("Failed to read the position events sync (err %d)", err);
+        return;
+    }
+    slot->position_events_sync_pending = true;
+}
+
+static void split_central_position_changed(uint8_t position, bool pressed, int64_t timestamp,
+                                          void *user_data) {
+    struct peripheral_slot *slot = user_data;
+    queue_peripheral_event(slot - peripherals, position, pressed, timestamp);
+}
+
+static void split_central_position_events(struct bt_conn *conn, struct peripheral_slot *slot,
+                                          const uint8_t *data, uint16_t length) {
+    bool synced = slot->position_events.synced;
+    int err = zmk_split_position_events_receive(&slot->position_events, slot->position_state,
+                                                data, length, k_uptime_get(),
+                                                split_central_position_changed, slot);
+    switch (err) {
+    case -EINVAL:
+        LOG_ERR("Invalid position events of length %u", length);
+        break;
+    case -EAGAIN:
+        if (synced) {
+            LOG_WRN("Lost position event notification(s), resyncing");
+        }
+        split_central_sync_position_events(conn, slot);
+        break;
+    }
+}
+
 static uint8_t split_central_notify_func(struct bt_conn *conn,
                                          struct bt_gatt_subscribe_params *params, const void *data,
                                          uint16_t length) {
@@ -180,43 +308,47 @@ static uint8_t split_central_notify_func(struct bt_conn *conn,
 
     LOG_DBG("[NOTIFICATION] data %p length %u", data, length);
 
-    for (int i = 0; i < POSITION_STATE_DATA_LEN; i++) {
-        slot->changed_positions[i] = ((uint8_t *)data)[i] ^ slot->position_state[i];
-        slot->position_state[i] = ((uint8_t *)data)[i];
-        LOG_DBG("data: %d", slot->position_state[i]);
+    if (params->value_handle == slot->position_events_handle) {
+        split_central_position_events(conn, slot, data, length);
+    } else if (length >= POSITION_STATE_DATA_LEN) {
+        split_central_update_position_state(slot, data, k_uptime_get());
     }
 
-    for (int i = 0; i < POSITION_STATE_DATA_LEN; i++) {
-        for (int j = 0; j < 8; j++) {
-            if (slot->changed_positions[i] & BIT(j)) {
-                uint32_t position = (i * 8) + j;
-                bool pressed = slot->position_state[i] & BIT(j);
-                struct zmk_position_state_changed ev = {.source =
-                                                            peripheral_slot_index_for_conn(conn),
-                                                        .position = position,
-                                                        .state = pressed,
-                                                        .timestamp = k_uptime_get()};
-
-                k_msgq_put(&peripheral_event_msgq, &ev, K_NO_WAIT);
-                k_work_submit(&peripheral_event_work);
-            }
-        }
+    return BT_GATT_ITER_CONTINUE;
+}
+
+static void split_central_subscribed(struct bt_conn *conn, uint8_t err,
+                                     struct bt_gatt_subscribe_params *params) {
+    struct peripheral_slot *slot = peripheral_slot_for_conn(conn);
+    if (slot == NULL || err) {
+        return;
     }
 
-    return BT_GATT_ITER_CONTINUE;
+    // Sync only once notifications are enabled, so no change falls between the sync and them.
+    if (params->value_handle == slot->position_events_handle) {
+        split_central_sync_position_events(conn, slot);
+    }
 }
 
-static void split_central_subscribe(struct bt_conn *conn) {
+static void split_central_subscribe(struct bt_conn *conn, uint16_t value_handle) {
     struct peripheral_slot *slot = peripheral_slot_for_conn(conn);
     if (slot == NULL) {
         LOG_ERR("No peripheral state found for connection");
         return;
     }
 
+    slot->subscribe_params.disc_params = &slot->sub_discover_params;
+    slot->subscribe_params.end_handle = slot->discover_params.end_handle;
+    slot->subscribe_params.value_handle = value_handle;
+    slot->subscribe_params.notify = split_central_notify_func;
+    slot->subscribe_params.subscribe = split_central_subscribed;
+    slot->subscribe_params.value = BT_GATT_CCC_NOTIFY;
+
     int err = bt_gatt_subscribe(conn, &slot->subscribe_params);
     switch (err) {
     case -EALREADY:
         LOG_DBG("[ALREADY SUBSCRIBED]");
+        split_central_subscribed(conn, 0, &slot->subscribe_params);
         break;
     case 0:
         LOG_DBG("[SUBSCRIBED]");
@@ -227,11 +359,88 @@ static void split_central_subscribe(struct bt_conn *conn) {
     }
 }
 
+// Without the hash no behaviors are invoked on the peripheral, so a failed read is retried a few
+// times before giving up on the connection.
+static void split_central_retry_behaviors_hash(struct peripheral_slot *slot) {
+    if (slot->behaviors_hash_retries >= BEHAVIORS_HASH_READ_RETRIES) {
+        LOG_ERR("Couldn't read the peripheral behaviors hash, not invoking behaviors on it until "
+                "it reconnects");
+        return;
+    }
+
+    slot->behaviors_hash_retries++;
+    k_work_reschedule(&slot->behaviors_hash_retry_work, K_MSEC(BEHAVIORS_HASH_RETRY_MS));
+}
+
+static uint8_t split_central_behaviors_hash_func(struct bt_conn *conn, uint8_t err,
+                                                 struct bt_gatt_read_params *params,
+                                                 const void *data, uint16_t length) {
+    struct peripheral_slot *slot = peripheral_slot_for_conn(conn);
+    if (slot == NULL) {
+        LOG_ERR("No peripheral state found for connection");
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (err || !data || length != sizeof(uint32_t)) {
+        LOG_WRN("Failed to read the peripheral behaviors hash (err %d)", err);
+        split_central_retry_behaviors_hash(slot);
+        return BT_GATT_ITER_STOP;
+    }
+
+    uint32_t hash = sys_get_le32(data);
+    slot->behaviors_match = (hash == zmk_split_behaviors_hash());
+    if (!slot->behaviors_match) {
+        LOG_ERR("Peripheral behaviors differ from the central's (hash %08x, expected %08x), not "
+                "invoking behaviors on it. Build both halves from the same keymap and firmware",
+                hash, zmk_split_behaviors_hash());
+    }
+
+    return BT_GATT_ITER_STOP;
+}
+
+static void split_central_read_behaviors_hash(struct bt_conn *conn, struct peripheral_slot *slot) {
+    slot->behaviors_hash_params.func = split_central_behaviors_hash_func;
+    slot->behaviors_hash_params.handle_count = 1;
+    slot->behaviors_hash_params.single.handle = slot->behaviors_hash_handle;
+    slot->behaviors_hash_params.single.offset = 0;
+
+    int err = bt_gatt_read(conn, &slot->behaviors_hash_params);
+    if (err) {
+        LOG_WRN("Failed to read the peripheral behaviors hash (err %d)", err);
+        split_central_retry_behaviors_hash(slot);
+    }
+}
+
+static void split_central_behaviors_hash_retry_callback(struct k_work *work) {
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    struct peripheral_slot *slot =
+        CONTAINER_OF(dwork, struct peripheral_slot, behaviors_hash_retry_work);
+
+    if (slot->state != PERIPHERAL_SLOT_STATE_CONNECTED || !slot->behaviors_hash_handle) {
+        return;
+    }
+
+    split_central_read_behaviors_hash(slot->conn, slot);
+}
+
 static uint8_t split_central_chrc_discovery_func(struct bt_conn *conn,
                                                  const struct bt_gatt_attr *attr,
                                                  struct bt_gatt_discover_params *params) {
+    struct peripheral_slot *slot = peripheral_slot_for_conn(conn);
+    if (slot == NULL) {
+        LOG_ERR("No peripheral state found for connection");
+        return BT_GATT_ITER_STOP;
+    }
+
     if (!attr) {
         LOG_DBG("Discover complete");
+        // Peripherals without the position events characteristic notify the whole position state.
+        if (!slot->subscribe_params.value_handle && slot->position_state_handle) {
+            split_central_subscribe(conn, slot->position_state_handle);
+        }
+        if (!slot->behaviors_hash_handle) {
+            LOG_WRN("Peripheral has no behaviors hash, behaviors won't be invoked on it");
+        }
         return BT_GATT_ITER_STOP;
     }
 
@@ -240,34 +449,30 @@ static uint8_t split_central_chrc_discovery_func(struct bt_conn *conn,
         return BT_GATT_ITER_STOP;
     }
 
-    struct peripheral_slot *slot = peripheral_slot_for_conn(conn);
-    if (slot == NULL) {
-        LOG_ERR("No peripheral state found for connection");
-        return BT_GATT_ITER_STOP;
-    }
-
     LOG_DBG("[ATTRIBUTE] handle %u", attr->handle);
 
     if (!bt_uuid_cmp(((struct bt_gatt_chrc *)attr->user_data)->uuid,
                      BT_UUID_DECLARE_128(ZMK_SPLIT_BT_CHAR_POSITION_STATE_UUID))) {
         LOG_DBG("Found position state characteristic");
-        slot->discover_params.uuid = NULL;
-        slot->discover_params.start_handle = attr->handle + 2;
-        slot->discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
-
-        slot->subscribe_params.disc_params = &slot->sub_discover_params;
-        slot->subscribe_params.end_handle = slot->discover_params.end_handle;
-        slot->subscribe_params.value_handle = bt_gatt_attr_value_handle(attr);
-        slot->subscribe_params.notify = split_central_notify_func;
-        slot->subscribe_params.value = BT_GATT_CCC_NOTIFY;
-        split_central_subscribe(conn);
+        slot->position_state_handle = bt_gatt_attr_value_handle(attr);
+    } else if (!bt_uuid_cmp(((struct bt_gatt_chrc *)attr->user_data)->uuid,
+                            BT_UUID_DECLARE_128(ZMK_SPLIT_BT_CHAR_POSITION_EVENTS_UUID))) {
+        LOG_DBG("Found position events characteristic");
+        slot->position_events_handle = bt_gatt_attr_value_handle(attr);
+        split_central_subscribe(conn, slot->position_events_handle);
     } else if (!bt_uuid_cmp(((struct bt_gatt_chrc *)attr->user_data)->uuid,
                             BT_UUID_DECLARE_128(ZMK_SPLIT_BT_CHAR_RUN_BEHAVIOR_UUID))) {
         LOG_DBG("Found run behavior handle");
         slot->run_behavior_handle = bt_gatt_attr_value_handle(attr);
+    } else if (!bt_uuid_cmp(((struct bt_gatt_chrc *)attr->user_data)->uuid,
+                            BT_UUID_DECLARE_128(ZMK_SPLIT_BT_CHAR_BEHAVIORS_HASH_UUID))) {
+        LOG_DBG("Found behaviors hash characteristic");
+        slot->behaviors_hash_handle = bt_gatt_attr_value_handle(attr);
+        split_central_read_behaviors_hash(conn, slot);
     }
 
-    bool subscribed = (slot->run_behavior_handle && slot->subscribe_params.value_handle);
+    bool subscribed = (slot->run_behavior_handle && slot->position_events_handle &&
+                       slot->behaviors_hash_handle);
 
     return subscribed ? BT_GATT_ITER_STOP : BT_GATT_ITER_CONTINUE;
 }
@@ -519,24 +724,59 @@ K_MSGQ_DEFINE(zmk_split_central_split_run_msgq,
               sizeof(struct zmk_split_run_behavior_payload_wrapper),
               CONFIG_ZMK_BLE_SPLIT_CENTRAL_SPLIT_RUN_QUEUE_SIZE, 4);
 
+static void split_central_write_run_behavior(uint8_t source,
+                                             const struct zmk_split_run_behavior_payload *payloads,
+                                             size_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    int err = bt_gatt_write_without_response(
+        peripherals[source].conn, peripherals[source].run_behavior_handle, payloads,
+        count * sizeof(struct zmk_split_run_behavior_payload), true);
+
+    if (err) {
+        LOG_ERR("Failed to write the behavior characteristic (err %d)", err);
+    }
+}
+
+// Writes without response go out at the next connection event, so the commands queued for each
+// peripheral by then are sent together in as few writes as the ATT MTU allows.
 void split_central_split_run_callback(struct k_work *work) {
     struct zmk_split_run_behavior_payload_wrapper payload_wrapper;
+    // only ever used from the split run work queue, and kept off its small stack
+    static struct zmk_split_run_behavior_payload
+        payloads[ZMK_BLE_SPLIT_PERIPHERAL_COUNT][CONFIG_ZMK_BLE_SPLIT_CENTRAL_SPLIT_RUN_QUEUE_SIZE];
+    size_t counts[ZMK_BLE_SPLIT_PERIPHERAL_COUNT] = {0};
 
     LOG_DBG("");
 
     while (k_msgq_get(&zmk_split_central_split_run_msgq, &payload_wrapper, K_NO_WAIT) == 0) {
-        if (peripherals[payload_wrapper.source].state != PERIPHERAL_SLOT_STATE_CONNECTED) {
+        uint8_t source = payload_wrapper.source;
+        if (peripherals[source].state != PERIPHERAL_SLOT_STATE_CONNECTED) {
             LOG_ERR("Source not connected");
             continue;
         }
 
-        int err = bt_gatt_write_without_response(
-            peripherals[payload_wrapper.source].conn,
-            peripherals[payload_wrapper.source].run_behavior_handle, &payload_wrapper.payload,
-            sizeof(struct zmk_split_run_behavior_payload), true);
+        if (!peripherals[source].behaviors_match) {
+            LOG_WRN("Behaviors of peripheral %d not known to match, dropping behavior", source);
+            continue;
+        }
 
-        if (err) {
-            LOG_ERR("Failed to write the behavior characteristic (err %d)", err);
+        size_t max_count = (bt_gatt_get_mtu(peripherals[source].conn) - 3) /
+                           sizeof(struct zmk_split_run_behavior_payload);
+        max_count = CLAMP(max_count, 1, ARRAY_SIZE(payloads[source]));
+        if (counts[source] >= max_count) {
+            split_central_write_run_behavior(source, payloads[source], counts[source]);
+            counts[source] = 0;
+        }
+
+        payloads[source][counts[source]++] = payload_wrapper.payload;
+    }
+
+    for (int i = 0; i < ZMK_BLE_SPLIT_PERIPHERAL_COUNT; i++) {
+        if (peripherals[i].state == PERIPHERAL_SLOT_STATE_CONNECTED) {
+            split_central_write_run_behavior(i, payloads[i], counts[i]);
         }
     }
 }
@@ -569,19 +809,24 @@ split_bt_invoke_behavior_payload(struct zmk_split_run_behavior_payload_wrapper p
 
 int zmk_split_bt_invoke_behavior(uint8_t source, struct zmk_behavior_binding *binding,
                                  struct zmk_behavior_binding_event event, bool state) {
-    struct zmk_split_run_behavior_payload payload = {.data = {
-                                                         .param1 = binding->param1,
-                                                         .param2 = binding->param2,
-                                                         .position = event.position,
-                                                         .state = state ? 1 : 0,
-                                                     }};
-    const size_t payload_dev_size = sizeof(payload.behavior_dev);
-    if (strlcpy(payload.behavior_dev, binding->behavior_dev, payload_dev_size) >=
-        payload_dev_size) {
-        LOG_ERR("Truncated behavior label %s to %s before invoking peripheral behavior",
-                log_strdup(binding->behavior_dev), log_strdup(payload.behavior_dev));
+    int index = zmk_split_behavior_index(behavior_binding_get_device(binding));
+    if (index < 0) {
+        LOG_ERR("Behavior %s can't be invoked on peripherals", log_strdup(binding->behavior_dev));
+        return index;
+    }
+
+    if (event.position > ZMK_SPLIT_RUN_BEHAVIOR_POSITION_MASK) {
+        LOG_ERR("Position %d can't be sent to peripherals", event.position);
+        return -EINVAL;
     }
 
+    struct zmk_split_run_behavior_payload payload = {
+        .behavior = index,
+        .position = event.position | (state ? ZMK_SPLIT_RUN_BEHAVIOR_PRESSED : 0),
+        .param1 = sys_cpu_to_le32(binding->param1),
+        .param2 = sys_cpu_to_le32(binding->param2),
+    };
+
     struct zmk_split_run_behavior_payload_wrapper wrapper = {.source = source, .payload = payload};
     return split_bt_invoke_behavior_payload(wrapper);
 }
@@ -590,6 +835,10 @@ int zmk_split_bt_central_init(const struct device *_arg) {
     k_work_queue_start(&split_central_split_run_q, split_central_split_run_q_stack,
                        K_THREAD_STACK_SIZEOF(split_central_split_run_q_stack),
                        CONFIG_ZMK_BLE_THREAD_PRIORITY, NULL);
+    for (int i = 0; i < ZMK_BLE_SPLIT_PERIPHERAL_COUNT; i++) {
+        k_work_init_delayable(&peripherals[i].behaviors_hash_retry_work,
+                              split_central_behaviors_hash_retry_callback);
+    }
     bt_conn_cb_register(&conn_callbacks);
 
     return start_scan();
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stddef.h>
+
+#include <sys/byteorder.h>
+#include <sys/util.h>
+
+#include <zmk/split/bluetooth/service.h>
+#include <zmk/split/bluetooth/position_events.h>
+
+void zmk_split_position_events_reset(struct zmk_split_position_events_receiver *receiver) {
+    receiver->synced = false;
+    receiver->next_seq = 0;
+    zmk_split_clock_offset_reset(&receiver->clock);
+}
+
+void zmk_split_position_events_synced(struct zmk_split_position_events_receiver *receiver,
+                                      uint8_t seq) {
+    receiver->next_seq = seq;
+    receiver->synced = true;
+}
+
+int zmk_split_position_events_receive(struct zmk_split_position_events_receiver *receiver,
+                                      uint8_t *position_state, const uint8_t *data,
+                                      uint16_t length, int64_t now,
+                                      zmk_split_position_changed_t changed, void *user_data) {
+    const size_t header_len = offsetof(struct zmk_split_position_events, events);
+    if (length < header_len || (length - header_len) % sizeof(struct zmk_split_position_event)) {
+        return -EINVAL;
+    }
+
+    const struct zmk_split_position_events *events = (const struct zmk_split_position_events *)data;
+    uint32_t sent_at = sys_le32_to_cpu(events->sent_at);
+    zmk_split_clock_offset_update(&receiver->clock, sent_at, now);
+
+    if (!receiver->synced) {
+        return -EAGAIN;
+    }
+
+    int8_t seq_diff = (int8_t)(events->seq - receiver->next_seq);
+    if (seq_diff < 0) {
+        // sent before the sync, so already part of it
+        return 0;
+    }
+    if (seq_diff > 0) {
+        receiver->synced = false;
+        return -EAGAIN;
+    }
+    receiver->next_seq++;
+
+    size_t count = (length - header_len) / sizeof(struct zmk_split_position_event);
+    for (int i = 0; i < count; i++) {
+        const struct zmk_split_position_event *ev = &events->events[i];
+        uint8_t position = ev->position & ZMK_SPLIT_POSITION_EVENT_POSITION_MASK;
+        bool pressed = ev->position & ZMK_SPLIT_POSITION_EVENT_PRESSED;
+
+        // A change that happened while the sync was read can be part of both.
+        if (((position_state[position / 8] & BIT(position % 8)) != 0) == pressed) {
+            continue;
+        }
+
+        // whatever the drift estimate says, the event happened before it was received
+        int64_t timestamp = zmk_split_clock_offset_to_central(
+            &receiver->clock, sent_at - sys_le16_to_cpu(ev->age));
+
+        WRITE_BIT(position_state[position / 8], position % 8, pressed);
+        changed(position, pressed, MIN(timestamp, now), user_data);
+    }
+
+    return 0;
+}
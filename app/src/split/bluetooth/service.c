@@ -5,6 +5,7 @@
  */
 
 #include <zephyr/types.h>
+#include <sys/byteorder.h>
 #include <sys/util.h>
 #include <init.h>
 
@@ -18,62 +19,72 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 #include <drivers/behavior.h>
 #include <zmk/behavior.h>
 #include <zmk/matrix.h>
+#include <zmk/split/behaviors.h>
 #include <zmk/split/bluetooth/uuid.h>
 #include <zmk/split/bluetooth/service.h>
 
-#define POS_STATE_LEN 16
+#define POS_STATE_LEN ZMK_SPLIT_POSITION_STATE_LEN
 
 static uint8_t num_of_positions = ZMK_KEYMAP_LEN;
 static uint8_t position_state[POS_STATE_LEN];
 
-static struct zmk_split_run_behavior_payload behavior_run_payload;
-
 static ssize_t split_svc_pos_state(struct bt_conn *conn, const struct bt_gatt_attr *attrs,
                                    void *buf, uint16_t len, uint16_t offset) {
     return bt_gatt_attr_read(conn, attrs, buf, len, offset, &position_state,
                              sizeof(position_state));
 }
 
+static void run_behavior(const struct zmk_split_run_behavior_payload *payload, int64_t timestamp) {
+    const struct device *behavior = zmk_split_behavior_get(payload->behavior);
+    if (behavior == NULL) {
+        LOG_ERR("No behavior with index %d", payload->behavior);
+        return;
+    }
+
+    struct zmk_behavior_binding binding = {
+        .behavior_dev = (char *)zmk_split_behavior_label(payload->behavior),
+        .behavior = behavior,
+        .param1 = sys_le32_to_cpu(payload->param1),
+        .param2 = sys_le32_to_cpu(payload->param2),
+    };
+    struct zmk_behavior_binding_event event = {
+        .position = payload->position & ZMK_SPLIT_RUN_BEHAVIOR_POSITION_MASK,
+        .timestamp = timestamp};
+    bool pressed = payload->position & ZMK_SPLIT_RUN_BEHAVIOR_PRESSED;
+
+    LOG_DBG("%s with params %d %d: pressed? %d", log_strdup(binding.behavior_dev), binding.param1,
+            binding.param2, pressed);
+
+    int err;
+    if (pressed) {
+        err = behavior_keymap_binding_pressed(&binding, event);
+    } else {
+        err = behavior_keymap_binding_released(&binding, event);
+    }
+
+    if (err) {
+        LOG_ERR("Failed to invoke behavior %s: %d", log_strdup(binding.behavior_dev), err);
+    }
+}
+
 static ssize_t split_svc_run_behavior(struct bt_conn *conn, const struct bt_gatt_attr *attrs,
                                       const void *buf, uint16_t len, uint16_t offset,
                                       uint8_t flags) {
-    struct zmk_split_run_behavior_payload *payload = attrs->user_data;
-    uint16_t end_addr = offset + len;
+    const struct zmk_split_run_behavior_payload *payloads = buf;
+    int64_t timestamp = k_uptime_get();
 
     LOG_DBG("offset %d len %d", offset, len);
 
-    if (end_addr > sizeof(struct zmk_split_run_behavior_payload)) {
+    if (offset != 0) {
         return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
     }
 
-    memcpy(payload + offset, buf, len);
-
-    // We run if:
-    // 1: We've gotten all the position/state/param data.
-    // 2: We have a null terminated string for the behavior device label.
-    const size_t behavior_dev_offset =
-        offsetof(struct zmk_split_run_behavior_payload, behavior_dev);
-    if ((end_addr > sizeof(struct zmk_split_run_behavior_data)) &&
-        payload->behavior_dev[end_addr - behavior_dev_offset - 1] == '\0') {
-        struct zmk_behavior_binding binding = {
-            .param1 = payload->data.param1,
-            .param2 = payload->data.param2,
-            .behavior_dev = payload->behavior_dev,
-        };
-        LOG_DBG("%s with params %d %d: pressed? %d", log_strdup(binding.behavior_dev),
-                binding.param1, binding.param2, payload->data.state);
-        struct zmk_behavior_binding_event event = {.position = payload->data.position,
-                                                   .timestamp = k_uptime_get()};
-        int err;
-        if (payload->data.state > 0) {
-            err = behavior_keymap_binding_pressed(&binding, event);
-        } else {
-            err = behavior_keymap_binding_released(&binding, event);
-        }
+    if (len == 0 || len % sizeof(struct zmk_split_run_behavior_payload) != 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
 
-        if (err) {
-            LOG_ERR("Failed to invoke behavior %s: %d", log_strdup(binding.behavior_dev), err);
-        }
+    for (int i = 0; i < len / sizeof(struct zmk_split_run_behavior_payload); i++) {
+        run_behavior(&payloads[i], timestamp);
     }
 
     return len;
@@ -84,8 +95,58 @@ static ssize_t split_svc_num_of_positions(struct bt_conn *conn, const struct bt_
     return bt_gatt_attr_read(conn, attrs, buf, len, offset, attrs->user_data, sizeof(uint8_t));
 }
 
+// Centrals that predate the position events characteristic subscribe to the position state.
+static bool position_state_notify_enabled;
+
 static void split_svc_pos_state_ccc(const struct bt_gatt_attr *attr, uint16_t value) {
     LOG_DBG("value %d", value);
+    position_state_notify_enabled = (value == BT_GATT_CCC_NOTIFY);
+}
+
+struct position_event {
+    uint8_t position;
+    bool pressed;
+    int64_t timestamp;
+};
+
+static struct position_event position_events[CONFIG_ZMK_SPLIT_BLE_PERIPHERAL_POSITION_QUEUE_SIZE];
+static size_t position_events_head;
+static size_t position_events_len;
+static uint8_t position_events_seq;
+// Events taken from the queue for the next notification, with its sequence number. They are kept
+// until the stack accepts the notification, so running out of buffers doesn't lose them.
+static struct position_event pending_events[ZMK_SPLIT_POSITION_EVENTS_MAX];
+static size_t pending_events_len;
+static uint8_t pending_events_seq;
+static bool position_events_notify_enabled;
+// Guards position_state together with the queued events, so a sync read sees a consistent pair.
+static struct k_spinlock position_events_lock;
+
+static ssize_t split_svc_pos_events_sync(struct bt_conn *conn, const struct bt_gatt_attr *attrs,
+                                         void *buf, uint16_t len, uint16_t offset) {
+    struct zmk_split_position_events_sync sync;
+
+    k_spinlock_key_t key = k_spin_lock(&position_events_lock);
+    // Queued events are part of the snapshot, so they are not notified afterwards.
+    position_events_len = 0;
+    pending_events_len = 0;
+    sync.seq = position_events_seq;
+    memcpy(sync.position_state, position_state, sizeof(sync.position_state));
+    k_spin_unlock(&position_events_lock, key);
+
+    return bt_gatt_attr_read(conn, attrs, buf, len, offset, &sync, sizeof(sync));
+}
+
+static ssize_t split_svc_behaviors_hash(struct bt_conn *conn, const struct bt_gatt_attr *attrs,
+                                        void *buf, uint16_t len, uint16_t offset) {
+    uint32_t hash = sys_cpu_to_le32(zmk_split_behaviors_hash());
+
+    return bt_gatt_attr_read(conn, attrs, buf, len, offset, &hash, sizeof(hash));
+}
+
+static void split_svc_pos_events_ccc(const struct bt_gatt_attr *attr, uint16_t value) {
+    LOG_DBG("value %d", value);
+    position_events_notify_enabled = (value == BT_GATT_CCC_NOTIFY);
 }
 
 BT_GATT_SERVICE_DEFINE(
@@ -96,9 +157,16 @@ BT_GATT_SERVICE_DEFINE(
     BT_GATT_CCC(split_svc_pos_state_ccc, BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_ENCRYPT),
     BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(ZMK_SPLIT_BT_CHAR_RUN_BEHAVIOR_UUID),
                            BT_GATT_CHRC_WRITE_WITHOUT_RESP, BT_GATT_PERM_WRITE_ENCRYPT, NULL,
-                           split_svc_run_behavior, &behavior_run_payload),
+                           split_svc_run_behavior, NULL),
     BT_GATT_DESCRIPTOR(BT_UUID_NUM_OF_DIGITALS, BT_GATT_PERM_READ, split_svc_num_of_positions, NULL,
-                       &num_of_positions), );
+                       &num_of_positions),
+    BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(ZMK_SPLIT_BT_CHAR_POSITION_EVENTS_UUID),
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_READ_ENCRYPT,
+                           split_svc_pos_events_sync, NULL, NULL),
+    BT_GATT_CCC(split_svc_pos_events_ccc, BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_ENCRYPT),
+    BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(ZMK_SPLIT_BT_CHAR_BEHAVIORS_HASH_UUID),
+                           BT_GATT_CHRC_READ, BT_GATT_PERM_READ_ENCRYPT, split_svc_behaviors_hash,
+                           NULL, NULL), );
 
 K_THREAD_STACK_DEFINE(service_q_stack, CONFIG_ZMK_SPLIT_BLE_PERIPHERAL_STACK_SIZE);
 
@@ -121,6 +189,10 @@ void send_position_state_callback(struct k_work *work) {
 K_WORK_DEFINE(service_position_notify_work, send_position_state_callback);
 
 int send_position_state() {
+    if (!position_state_notify_enabled) {
+        return 0;
+    }
+
     int err = k_msgq_put(&position_state_msgq, position_state, K_MSEC(100));
     if (err) {
         switch (err) {
@@ -141,16 +213,135 @@ int send_position_state() {
     return 0;
 }
 
-int zmk_split_bt_position_pressed(uint8_t position) {
-    WRITE_BIT(position_state[position / 8], position % 8, true);
-    return send_position_state();
+// A notification that was not reported sent by then is assumed lost with its connection.
+#define POSITION_EVENTS_SENT_TIMEOUT_MS 100
+// How long to wait for a free notification buffer before trying again
+#define POSITION_EVENTS_RETRY_MS 10
+
+static bool position_events_in_flight;
+static int64_t position_events_sent_at;
+
+static void send_position_events_callback(struct k_work *work);
+
+K_WORK_DEFINE(service_position_events_notify_work, send_position_events_callback);
+K_WORK_DELAYABLE_DEFINE(service_position_events_retry_work, send_position_events_callback);
+
+static void position_events_sent(struct bt_conn *conn, void *user_data) {
+    k_spinlock_key_t key = k_spin_lock(&position_events_lock);
+    position_events_in_flight = false;
+    bool pending = position_events_len > 0;
+    k_spin_unlock(&position_events_lock, key);
+
+    if (pending) {
+        k_work_submit_to_queue(&service_work_q, &service_position_events_notify_work);
+    }
+}
+
+// Sends every queued event that fits in one notification. Only one notification is in flight at a
+// time, so the events from one connection interval are sent together in the next.
+static void send_position_events_callback(struct k_work *work) {
+    struct zmk_split_position_events payload;
+    int64_t now = k_uptime_get();
+
+    k_spinlock_key_t key = k_spin_lock(&position_events_lock);
+    if (position_events_in_flight &&
+        now - position_events_sent_at > POSITION_EVENTS_SENT_TIMEOUT_MS) {
+        position_events_in_flight = false;
+    }
+    if (position_events_in_flight || (pending_events_len == 0 && position_events_len == 0)) {
+        k_spin_unlock(&position_events_lock, key);
+        return;
+    }
+
+    if (pending_events_len == 0) {
+        pending_events_seq = position_events_seq++;
+        while (pending_events_len < ZMK_SPLIT_POSITION_EVENTS_MAX && position_events_len > 0) {
+            pending_events[pending_events_len++] = position_events[position_events_head];
+            position_events_head = (position_events_head + 1) % ARRAY_SIZE(position_events);
+            position_events_len--;
+        }
+    }
+
+    size_t count = pending_events_len;
+    payload.seq = pending_events_seq;
+    payload.sent_at = sys_cpu_to_le32((uint32_t)now);
+    for (size_t i = 0; i < count; i++) {
+        const struct position_event *ev = &pending_events[i];
+        payload.events[i] = (struct zmk_split_position_event){
+            .position = ev->position | (ev->pressed ? ZMK_SPLIT_POSITION_EVENT_PRESSED : 0),
+            .age = sys_cpu_to_le16(MIN(MAX(now - ev->timestamp, 0), UINT16_MAX)),
+        };
+    }
+    position_events_in_flight = true;
+    position_events_sent_at = now;
+    k_spin_unlock(&position_events_lock, key);
+
+    struct bt_gatt_notify_params params = {
+        .attr = &split_svc.attrs[7],
+        .data = &payload,
+        .len = offsetof(struct zmk_split_position_events, events) +
+               count * sizeof(struct zmk_split_position_event),
+        .func = position_events_sent,
+    };
+    int err = bt_gatt_notify_cb(NULL, &params);
+
+    key = k_spin_lock(&position_events_lock);
+    if (err == -ENOMEM) {
+        // Keep the events and their sequence number until a buffer is free.
+        position_events_in_flight = false;
+        k_spin_unlock(&position_events_lock, key);
+        k_work_reschedule_for_queue(&service_work_q, &service_position_events_retry_work,
+                                    K_MSEC(POSITION_EVENTS_RETRY_MS));
+        return;
+    }
+    if (err) {
+        // Lost with the connection. The sequence number is skipped, so the central resyncs.
+        LOG_DBG("Error notifying %d", err);
+        position_events_in_flight = false;
+    }
+    pending_events_len = 0;
+    k_spin_unlock(&position_events_lock, key);
 }
 
-int zmk_split_bt_position_released(uint8_t position) {
-    WRITE_BIT(position_state[position / 8], position % 8, false);
+static int update_position_state(uint8_t position, bool pressed, int64_t timestamp) {
+    k_spinlock_key_t key = k_spin_lock(&position_events_lock);
+    WRITE_BIT(position_state[position / 8], position % 8, pressed);
+
+    bool queued = position_events_notify_enabled;
+    bool dropped = false;
+    if (queued) {
+        if (position_events_len == ARRAY_SIZE(position_events)) {
+            dropped = true;
+            position_events_head = (position_events_head + 1) % ARRAY_SIZE(position_events);
+            position_events_len--;
+            // skip a sequence number, so the central resyncs
+            position_events_seq++;
+        }
+        position_events[(position_events_head + position_events_len) %
+                        ARRAY_SIZE(position_events)] = (struct position_event){
+            .position = position, .pressed = pressed, .timestamp = timestamp};
+        position_events_len++;
+    }
+    k_spin_unlock(&position_events_lock, key);
+
+    if (dropped) {
+        LOG_WRN("Position event queue full, dropped the oldest event");
+    }
+    if (queued) {
+        k_work_submit_to_queue(&service_work_q, &service_position_events_notify_work);
+    }
+
     return send_position_state();
 }
 
+int zmk_split_bt_position_pressed(uint8_t position, int64_t timestamp) {
+    return update_position_state(position, true, timestamp);
+}
+
+int zmk_split_bt_position_released(uint8_t position, int64_t timestamp) {
+    return update_position_state(position, false, timestamp);
+}
+
 int service_init(const struct device *_arg) {
     static const struct k_work_queue_config queue_config = {
         .name = "Split Peripheral Notification Queue"};
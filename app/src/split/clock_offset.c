@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <sys/util.h>
+
+#include <zmk/split/clock_offset.h>
+
+#define WINDOW_MS 10000
+// a window with fewer samples is extended, as its minimum is too noisy to measure drift with
+#define WINDOW_MIN_SAMPLES 8
+// well above the tolerance of the crystals keyboards use, so noisy minima can't run away
+#define MAX_DRIFT_PPM 200
+
+static int64_t extend_peripheral_time(const struct zmk_split_clock_offset *clock,
+                                      uint32_t peripheral_time) {
+    // the peripheral sends its uptime truncated to 32 bits, which wraps after 49 days
+    return clock->peripheral_time + (int32_t)(peripheral_time - (uint32_t)clock->peripheral_time);
+}
+
+static int64_t project_offset(const struct zmk_split_clock_offset *clock,
+                              const struct zmk_split_clock_offset_window *window,
+                              int64_t central_time) {
+    return window->offset + (central_time - window->at) * clock->drift_ppm / 1000000;
+}
+
+static void update_drift(struct zmk_split_clock_offset *clock) {
+    // older windows count for less, so the estimate follows the drift changing with temperature
+    clock->drift_offset_us = clock->drift_offset_us * 7 / 8 +
+                             (clock->current.offset - clock->previous.offset) * 1000;
+    clock->drift_span_ms =
+        clock->drift_span_ms * 7 / 8 + (clock->current.at - clock->previous.at);
+
+    if (clock->drift_span_ms > 0) {
+        int64_t drift_ppm = clock->drift_offset_us * 1000 / clock->drift_span_ms;
+        clock->drift_ppm = CLAMP(drift_ppm, -MAX_DRIFT_PPM, MAX_DRIFT_PPM);
+    }
+}
+
+void zmk_split_clock_offset_reset(struct zmk_split_clock_offset *clock) {
+    *clock = (struct zmk_split_clock_offset){0};
+}
+
+void zmk_split_clock_offset_update(struct zmk_split_clock_offset *clock, uint32_t peripheral_time,
+                                   int64_t central_time) {
+    if (!clock->valid) {
+        clock->valid = true;
+        clock->peripheral_time = peripheral_time;
+    } else {
+        clock->peripheral_time = extend_peripheral_time(clock, peripheral_time);
+    }
+
+    struct zmk_split_clock_offset_window sample = {
+        .offset = central_time - clock->peripheral_time, .at = central_time, .samples = 1};
+
+    if (clock->current.samples == 0) {
+        clock->window_start = central_time;
+        clock->current = sample;
+        return;
+    }
+
+    if (central_time - clock->window_start < WINDOW_MS ||
+        clock->current.samples < WINDOW_MIN_SAMPLES) {
+        sample.samples = clock->current.samples + 1;
+        if (sample.offset >= clock->current.offset) {
+            sample.offset = clock->current.offset;
+            sample.at = clock->current.at;
+        }
+        clock->current = sample;
+        return;
+    }
+
+    if (clock->previous.samples > 0) {
+        update_drift(clock);
+    }
+    clock->previous = clock->current;
+    clock->window_start = central_time;
+    clock->current = sample;
+}
+
+int64_t zmk_split_clock_offset_to_central(const struct zmk_split_clock_offset *clock,
+                                          uint32_t peripheral_time) {
+    int64_t time = extend_peripheral_time(clock, peripheral_time);
+    int64_t offset = project_offset(clock, &clock->current, time + clock->current.offset);
+
+    if (clock->previous.samples > 0) {
+        offset = MIN(offset,
+                     project_offset(clock, &clock->previous, time + clock->previous.offset));
+    }
+
+    return time + offset;
+}
@@ -6,6 +6,8 @@
 
 #include <device.h>
 #include <init.h>
+#include <string.h>
+#include <sys/util.h>
 
 #include <usb/usb_device.h>
 #include <usb/class/usb_hid.h>
@@ -14,14 +16,198 @@
 #include <zmk/hid.h>
 #include <zmk/keymap.h>
 #include <zmk/event_manager.h>
+#include <zmk/events/usb_conn_state_changed.h>
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 static const struct device *hid_dev;
 
-static K_SEM_DEFINE(hid_sem, 1, 1);
+#define QUEUE_SIZE CONFIG_ZMK_USB_HID_REPORT_QUEUE_SIZE
+#define REPORT_MAX_LEN                                                                             \
+    MAX(sizeof(struct zmk_hid_keyboard_report), sizeof(struct zmk_hid_consumer_report))
 
-static void in_ready_cb(const struct device *dev) { k_sem_give(&hid_sem); }
+// How long a transfer may stay in flight before its completion is assumed lost and the report is
+// written again. Sending a report twice is harmless, as each carries the full state for its ID.
+#define TRANSFER_TIMEOUT_MS 30
+// How long to wait before writing the head again after the endpoint refused it
+#define WRITE_RETRY_MS 1
+
+struct queued_report {
+    uint8_t len;
+    uint8_t data[REPORT_MAX_LEN];
+};
+
+// Reports waiting to be sent, oldest first. The report at the head stays queued until a
+// completion arrives after the endpoint accepted it, so a failed write never loses a report.
+static struct queued_report report_queue[QUEUE_SIZE];
+static uint8_t queue_head;
+static uint8_t queue_len;
+// the endpoint accepted the head report, so the next completion means it was sent
+static bool head_written;
+static int64_t head_written_at;
+// bumped when the queue is reset, so a write that raced with the reset isn't counted for the head
+static uint32_t queue_generation;
+// a write is in progress, and another was asked for meanwhile
+static bool writing;
+static bool write_requested;
+static uint32_t queue_overflows;
+static struct k_spinlock queue_lock;
+
+static void retry_head_report(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(retry_work, retry_head_report);
+
+uint32_t zmk_usb_hid_queue_overflows() { return queue_overflows; }
+
+static struct queued_report *queued_report(uint8_t index) {
+    return &report_queue[(queue_head + index) % QUEUE_SIZE];
+}
+
+static bool head_needs_write() {
+    if (queue_len == 0) {
+        return false;
+    }
+
+    // the host never collected it, e.g. because the bus was suspended mid transfer
+    return !head_written || k_uptime_get() - head_written_at > TRANSFER_TIMEOUT_MS;
+}
+
+// Writes the head report if the endpoint hasn't accepted it yet. Only one caller writes at a
+// time; anyone finding a write in progress leaves the retry to that caller. The head is marked as
+// written before the write, so a completion arriving before hid_int_ep_write() returns still pops
+// it. A failed write, like -EAGAIN from a busy endpoint, keeps the report queued, and retry_work
+// writes it again shortly. retry_work also catches a transfer whose completion never arrives.
+static void write_head_report() {
+    k_spinlock_key_t key = k_spin_lock(&queue_lock);
+    if (writing) {
+        write_requested = true;
+        k_spin_unlock(&queue_lock, key);
+        return;
+    }
+    writing = true;
+
+    do {
+        write_requested = false;
+        if (!head_needs_write()) {
+            break;
+        }
+
+        struct queued_report report = *queued_report(0);
+        uint32_t generation = queue_generation;
+        head_written = true;
+        head_written_at = k_uptime_get();
+        k_spin_unlock(&queue_lock, key);
+
+        int err = hid_int_ep_write(hid_dev, report.data, report.len, NULL);
+
+        key = k_spin_lock(&queue_lock);
+        if (err) {
+            LOG_DBG("Failed to send USB HID report, will retry (err %d)", err);
+            if (generation == queue_generation) {
+                // no transfer was started, so no completion will pop the head
+                head_written = false;
+            }
+            k_work_reschedule(&retry_work, K_MSEC(WRITE_RETRY_MS));
+        } else {
+            k_work_reschedule(&retry_work, K_MSEC(TRANSFER_TIMEOUT_MS + 1));
+        }
+    } while (write_requested);
+
+    writing = false;
+    k_spin_unlock(&queue_lock, key);
+}
+
+static void retry_head_report(struct k_work *work) {
+    // Transfers wait for the host to resume the bus, and the queue is reset when it goes away.
+    if (zmk_usb_get_status() == USB_DC_SUSPEND || !zmk_usb_is_hid_ready()) {
+        return;
+    }
+
+    write_head_report();
+}
+
+static void in_ready_cb(const struct device *dev) {
+    k_spinlock_key_t key = k_spin_lock(&queue_lock);
+    // A completion with nothing written is left over from before a reset, and must not pop a
+    // report that was never sent.
+    if (head_written) {
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_len--;
+        head_written = false;
+    }
+    k_spin_unlock(&queue_lock, key);
+
+    write_head_report();
+}
+
+// Compares the report bodies that follow the one byte report IDs. Only keyboard reports start
+// with modifiers.
+static bool can_coalesce(const uint8_t *prev, const uint8_t *last, const uint8_t *next,
+                         size_t len) {
+    bool is_keyboard = next[0] == zmk_hid_get_keyboard_report()->report_id;
+    return zmk_hid_report_can_coalesce(prev + 1, last + 1, next + 1, len - 1,
+                                       is_keyboard ? sizeof(zmk_mod_flags_t) : 0);
+}
+
+// With the queue full, the newest report may only replace the last queued one if both follow a
+// queued report with the same ID, so it's known which transitions the replaced report carried.
+// The head is never replaced, it may be in flight.
+static bool coalesce_report_locked(const uint8_t *report, size_t len) {
+    if (queue_len < 2) {
+        return false;
+    }
+
+    struct queued_report *last = queued_report(queue_len - 1);
+    struct queued_report *prev = queued_report(queue_len - 2);
+
+    if (last->len != len || prev->len != len || last->data[0] != report[0] ||
+        prev->data[0] != report[0] || !can_coalesce(prev->data, last->data, report, len)) {
+        return false;
+    }
+
+    memcpy(last->data, report, len);
+    return true;
+}
+
+static int enqueue_report(const uint8_t *report, size_t len) {
+    if (len > REPORT_MAX_LEN) {
+        return -EINVAL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&queue_lock);
+
+    if (queue_len == QUEUE_SIZE) {
+        queue_overflows++;
+        bool coalesced = coalesce_report_locked(report, len);
+        k_spin_unlock(&queue_lock, key);
+
+        if (!coalesced) {
+            LOG_WRN("USB HID report queue full, dropping report");
+        }
+        // the head may have timed out, which would keep the queue full
+        write_head_report();
+
+        return coalesced ? 0 : -ENOMEM;
+    }
+
+    struct queued_report *slot = queued_report(queue_len);
+    memcpy(slot->data, report, len);
+    slot->len = len;
+    queue_len++;
+    k_spin_unlock(&queue_lock, key);
+
+    write_head_report();
+
+    return 0;
+}
+
+static void reset_queue() {
+    k_spinlock_key_t key = k_spin_lock(&queue_lock);
+    queue_len = 0;
+    head_written = false;
+    queue_generation++;
+    k_spin_unlock(&queue_lock, key);
+}
 
 static const struct hid_ops ops = {
     .int_in_ready = in_ready_cb,
@@ -37,17 +223,26 @@ int zmk_usb_hid_send_report(const uint8_t *report, size_t len) {
     case USB_DC_UNKNOWN:
         return -ENODEV;
     default:
-        k_sem_take(&hid_sem, K_MSEC(30));
-        int err = hid_int_ep_write(hid_dev, report, len, NULL);
-
-        if (err) {
-            k_sem_give(&hid_sem);
-        }
+        return enqueue_report(report, len);
+    }
+}
 
-        return err;
+static int usb_hid_listener(const zmk_event_t *eh) {
+    // Transfers in flight when the host goes away never complete, and whatever is still queued is
+    // stale by the time it comes back. Reports still queued when the bus was suspended go out
+    // once it resumes.
+    if (!zmk_usb_is_hid_ready()) {
+        reset_queue();
+    } else {
+        write_head_report();
     }
+
+    return 0;
 }
 
+ZMK_LISTENER(usb_hid_listener, usb_hid_listener);
+ZMK_SUBSCRIPTION(usb_hid_listener, zmk_usb_conn_state_changed);
+
 static int zmk_usb_hid_init(const struct device *_arg) {
     hid_dev = device_get_binding("HID_0");
     if (hid_dev == NULL) {
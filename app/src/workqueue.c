@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <kernel.h>
+#include <init.h>
+
+#include <zmk/workqueue.h>
+
+#if IS_ENABLED(CONFIG_ZMK_INPUT_WORK_QUEUE_DEDICATED)
+
+K_THREAD_STACK_DEFINE(input_work_stack_area, CONFIG_ZMK_INPUT_DEDICATED_THREAD_STACK_SIZE);
+
+static struct k_work_q input_work_q;
+
+#endif
+
+struct k_work_q *zmk_workqueue_input_work_q() {
+#if IS_ENABLED(CONFIG_ZMK_INPUT_WORK_QUEUE_DEDICATED)
+    return &input_work_q;
+#else
+    return &k_sys_work_q;
+#endif
+}
+
+#if IS_ENABLED(CONFIG_ZMK_INPUT_WORK_QUEUE_DEDICATED)
+
+static int zmk_workqueue_init(const struct device *_arg) {
+    static const struct k_work_queue_config queue_config = {.name = "Input Work"};
+    k_work_queue_start(&input_work_q, input_work_stack_area,
+                       K_THREAD_STACK_SIZEOF(input_work_stack_area),
+                       CONFIG_ZMK_INPUT_DEDICATED_THREAD_PRIORITY, &queue_config);
+    return 0;
+}
+
+// Start before the kscan drivers are initialized, so they can schedule scans right away.
+SYS_INIT(zmk_workqueue_init, POST_KERNEL, 0);
+
+#endif
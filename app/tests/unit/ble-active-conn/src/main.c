@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <ztest.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+
+#include <zmk/ble/active_conn.h>
+
+// Stubbed bt_conn layer. A connected conn holds one reference owned by the stack, like the host
+// stack does until after the disconnected callbacks have run.
+struct bt_conn {
+    bt_addr_le_t dst;
+    bool connected;
+    int refs;
+};
+
+static struct bt_conn conns[2];
+
+// Defined by the Bluetooth host, which isn't built
+const bt_addr_le_t bt_addr_le_any = {0};
+
+static const bt_addr_le_t host_a = {.type = BT_ADDR_LE_RANDOM, .a = {.val = {1, 2, 3, 4, 5, 6}}};
+static const bt_addr_le_t host_b = {.type = BT_ADDR_LE_RANDOM, .a = {.val = {6, 5, 4, 3, 2, 1}}};
+
+struct bt_conn *bt_conn_ref(struct bt_conn *conn) {
+    zassert_true(conn->refs > 0, "reference taken on a released conn");
+    conn->refs++;
+    return conn;
+}
+
+void bt_conn_unref(struct bt_conn *conn) {
+    zassert_true(conn->refs > 0, "conn released more often than referenced");
+    conn->refs--;
+}
+
+struct bt_conn *bt_conn_lookup_addr_le(uint8_t id, const bt_addr_le_t *peer) {
+    for (int i = 0; i < ARRAY_SIZE(conns); i++) {
+        if (conns[i].connected && bt_addr_le_cmp(&conns[i].dst, peer) == 0) {
+            return bt_conn_ref(&conns[i]);
+        }
+    }
+
+    return NULL;
+}
+
+const bt_addr_le_t *bt_conn_get_dst(const struct bt_conn *conn) { return &conn->dst; }
+
+static struct bt_conn *stack_connect(int index, const bt_addr_le_t *dst) {
+    struct bt_conn *conn = &conns[index];
+    bt_addr_le_copy(&conn->dst, dst);
+    conn->connected = true;
+    conn->refs = 1;
+    return conn;
+}
+
+static void stack_disconnect(struct bt_conn *conn) {
+    conn->connected = false;
+    bt_conn_unref(conn);
+}
+
+static void assert_refs(const struct bt_conn *conn, int expected) {
+    zassert_equal(conn->refs, expected, "conn %d holds %d references, expected %d",
+                  (int)(conn - conns), conn->refs, expected);
+}
+
+static void assert_active(struct bt_conn *expected) {
+    struct bt_conn *conn = zmk_ble_active_conn_get();
+    zassert_equal_ptr(conn, expected, NULL);
+    zassert_equal(zmk_ble_active_conn_is_set(), expected != NULL, NULL);
+    if (conn != NULL) {
+        bt_conn_unref(conn);
+    }
+}
+
+static void setup(void) { memset(conns, 0, sizeof(conns)); }
+
+// Switching to an open profile releases the tracked conn, after which only the stack may still
+// hold references.
+static void teardown(void) {
+    zmk_ble_active_conn_update(BT_ADDR_LE_ANY);
+    assert_active(NULL);
+
+    for (int i = 0; i < ARRAY_SIZE(conns); i++) {
+        assert_refs(&conns[i], conns[i].connected ? 1 : 0);
+    }
+}
+
+static void test_connect_disconnect(void) {
+    struct bt_conn *conn = stack_connect(0, &host_a);
+
+    zassert_true(zmk_ble_active_conn_connected(conn, &host_a), NULL);
+    assert_refs(conn, 2);
+    assert_active(conn);
+    assert_refs(conn, 2);
+
+    zassert_true(zmk_ble_active_conn_disconnected(conn), NULL);
+    assert_refs(conn, 1);
+    assert_active(NULL);
+
+    stack_disconnect(conn);
+    assert_refs(conn, 0);
+}
+
+static void test_connect_other_host(void) {
+    struct bt_conn *conn = stack_connect(1, &host_b);
+
+    zassert_false(zmk_ble_active_conn_connected(conn, &host_a), NULL);
+    assert_refs(conn, 1);
+    assert_active(NULL);
+
+    zassert_false(zmk_ble_active_conn_disconnected(conn), NULL);
+    assert_refs(conn, 1);
+}
+
+static void test_repeated_connect(void) {
+    struct bt_conn *conn = stack_connect(0, &host_a);
+
+    zassert_true(zmk_ble_active_conn_connected(conn, &host_a), NULL);
+    zassert_true(zmk_ble_active_conn_connected(conn, &host_a), NULL);
+    assert_refs(conn, 2);
+    assert_active(conn);
+}
+
+static void test_profile_switch(void) {
+    struct bt_conn *conn_a = stack_connect(0, &host_a);
+    struct bt_conn *conn_b = stack_connect(1, &host_b);
+
+    zassert_true(zmk_ble_active_conn_connected(conn_a, &host_a), NULL);
+
+    zmk_ble_active_conn_update(&host_b);
+    assert_refs(conn_a, 1);
+    assert_refs(conn_b, 2);
+    assert_active(conn_b);
+
+    zmk_ble_active_conn_update(&host_a);
+    assert_refs(conn_a, 2);
+    assert_refs(conn_b, 1);
+    assert_active(conn_a);
+
+    zmk_ble_active_conn_update(BT_ADDR_LE_ANY);
+    assert_refs(conn_a, 1);
+    assert_refs(conn_b, 1);
+    assert_active(NULL);
+}
+
+static void test_profile_switch_to_disconnected_host(void) {
+    struct bt_conn *conn_a = stack_connect(0, &host_a);
+
+    zassert_true(zmk_ble_active_conn_connected(conn_a, &host_a), NULL);
+
+    zmk_ble_active_conn_update(&host_b);
+    assert_refs(conn_a, 1);
+    assert_active(NULL);
+
+    zassert_false(zmk_ble_active_conn_disconnected(conn_a), NULL);
+    assert_refs(conn_a, 1);
+}
+
+static void test_address_change(void) {
+    struct bt_conn *conn_a = stack_connect(0, &host_a);
+
+    zassert_true(zmk_ble_active_conn_connected(conn_a, &host_a), NULL);
+
+    // The active profile is re-paired with host B, which connects after the address is stored.
+    zmk_ble_active_conn_update(&host_b);
+    assert_refs(conn_a, 1);
+    assert_active(NULL);
+
+    struct bt_conn *conn_b = stack_connect(1, &host_b);
+    zassert_true(zmk_ble_active_conn_connected(conn_b, &host_b), NULL);
+    assert_refs(conn_b, 2);
+    assert_active(conn_b);
+
+    // Host A disconnecting no longer affects the active profile.
+    zassert_false(zmk_ble_active_conn_disconnected(conn_a), NULL);
+    stack_disconnect(conn_a);
+    assert_refs(conn_a, 0);
+    assert_active(conn_b);
+}
+
+void test_main(void) {
+    ztest_test_suite(ble_active_conn,
+                     ztest_unit_test_setup_teardown(test_connect_disconnect, setup, teardown),
+                     ztest_unit_test_setup_teardown(test_connect_other_host, setup, teardown),
+                     ztest_unit_test_setup_teardown(test_repeated_connect, setup, teardown),
+                     ztest_unit_test_setup_teardown(test_profile_switch, setup, teardown),
+                     ztest_unit_test_setup_teardown(test_profile_switch_to_disconnected_host,
+                                                    setup, teardown),
+                     ztest_unit_test_setup_teardown(test_address_change, setup, teardown));
+    ztest_run_test_suite(ble_active_conn);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <ztest.h>
+
+#include "debounce.h"
+
+// Runs randomized bouncing inputs through debounce_group_update and, switch by switch, through
+// debounce_update, and checks that both agree on every step.
+
+#define STEPS 20000
+
+static uint32_t random_state;
+
+static uint32_t next_random(void) {
+    // xorshift32, so every run sees the same inputs
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void compare_with_scalar(const struct debounce_config *config, int max_elapsed_ms) {
+    struct debounce_state scalar[DEBOUNCE_GROUP_SIZE] = {};
+    struct debounce_group_state group = {};
+    uint32_t level = 0;
+
+    random_state = 0x2545F491;
+
+    for (int step = 0; step < STEPS; step++) {
+        // Each switch settles on a level for a while, and bounces around level changes.
+        level ^= next_random() & next_random() & next_random() & next_random();
+        const uint32_t bounce = next_random() & next_random() & next_random();
+        const uint32_t active = level ^ bounce;
+        const int elapsed_ms = next_random() % (max_elapsed_ms + 1);
+
+        debounce_group_update(&group, active, elapsed_ms, config);
+
+        uint32_t pressed = 0;
+        uint32_t changed = 0;
+        uint32_t is_active = 0;
+        for (int i = 0; i < DEBOUNCE_GROUP_SIZE; i++) {
+            debounce_update(&scalar[i], (active & BIT(i)) != 0, elapsed_ms, config);
+            pressed |= debounce_is_pressed(&scalar[i]) ? BIT(i) : 0;
+            changed |= debounce_get_changed(&scalar[i]) ? BIT(i) : 0;
+            is_active |= debounce_is_active(&scalar[i]) ? BIT(i) : 0;
+        }
+
+        zassert_equal(debounce_group_get_pressed(&group), pressed, "pressed differs at step %d",
+                      step);
+        zassert_equal(debounce_group_get_changed(&group), changed, "changed differs at step %d",
+                      step);
+        zassert_equal(debounce_group_get_active(&group), is_active, "active differs at step %d",
+                      step);
+    }
+}
+
+static void test_default_thresholds(void) {
+    struct debounce_config config = {.debounce_press_ms = 5, .debounce_release_ms = 5};
+    compare_with_scalar(&config, 1);
+}
+
+static void test_zero_thresholds(void) {
+    struct debounce_config config = {.debounce_press_ms = 0, .debounce_release_ms = 0};
+    compare_with_scalar(&config, 3);
+}
+
+static void test_asymmetric_thresholds(void) {
+    struct debounce_config config = {.debounce_press_ms = 1, .debounce_release_ms = 30};
+    compare_with_scalar(&config, 4);
+}
+
+static void test_large_elapsed_time(void) {
+    struct debounce_config config = {.debounce_press_ms = 5, .debounce_release_ms = 10};
+    compare_with_scalar(&config, 2 * DEBOUNCE_COUNTER_MAX);
+}
+
+static void test_saturating_thresholds(void) {
+    struct debounce_config config = {.debounce_press_ms = DEBOUNCE_COUNTER_MAX,
+                                     .debounce_release_ms = DEBOUNCE_COUNTER_MAX + 1};
+    compare_with_scalar(&config, 5000);
+}
+
+void test_main(void) {
+    ztest_test_suite(debounce_group, ztest_unit_test(test_default_thresholds),
+                     ztest_unit_test(test_zero_thresholds),
+                     ztest_unit_test(test_asymmetric_thresholds),
+                     ztest_unit_test(test_large_elapsed_time),
+                     ztest_unit_test(test_saturating_thresholds));
+    ztest_run_test_suite(debounce_group);
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <ztest.h>
+#include <errno.h>
+#include <sys/byteorder.h>
+
+#include <zmk/split/bluetooth/service.h>
+#include <zmk/split/bluetooth/position_events.h>
+
+// Replays typing on simulated peripherals through a transport with random delays and retries, and
+// checks how far the central times given to the events are from when the keys changed, compared to
+// stamping them with their receipt time minus the age the peripheral reports.
+
+#define CONNECTION_INTERVAL_US 15000
+#define TRANSPORT_DELAY_US 1000
+#define SIMULATED_EVENTS 2000
+#define MAX_AVERAGE_ERROR_US 2000
+
+struct clock_offset_scenario {
+    // peripheral uptime when the central boots
+    uint32_t peripheral_start_ms;
+    int32_t drift_ppm;
+    // percentage of notifications that need one or two retries
+    uint8_t retry_percent;
+    // the keyboard is left idle for idle_ms after idle_after events
+    int idle_after;
+    uint32_t idle_ms;
+};
+
+struct timing_error {
+    int64_t total_us;
+    int64_t max_us;
+};
+
+struct received_event {
+    uint8_t position;
+    bool pressed;
+    int64_t timestamp;
+};
+
+static struct zmk_split_position_events_receiver receiver;
+static uint8_t position_state[ZMK_SPLIT_POSITION_STATE_LEN];
+static struct received_event received[ZMK_SPLIT_POSITION_EVENTS_MAX];
+static int received_count;
+
+static uint32_t random_state;
+
+static uint32_t next_random(uint32_t range) {
+    // xorshift32, so every run sees the same inputs
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state % range;
+}
+
+static void position_changed(uint8_t position, bool pressed, int64_t timestamp, void *user_data) {
+    zassert_equal(user_data, &receiver, "unexpected user data");
+    zassert_true(received_count < ARRAY_SIZE(received), "too many events");
+    received[received_count++] = (struct received_event){
+        .position = position, .pressed = pressed, .timestamp = timestamp};
+}
+
+static int receive(uint8_t seq, uint32_t sent_at, const struct zmk_split_position_event *events,
+                   size_t count, int64_t now) {
+    struct zmk_split_position_events notification = {.seq = seq,
+                                                     .sent_at = sys_cpu_to_le32(sent_at)};
+    for (int i = 0; i < count; i++) {
+        notification.events[i].position = events[i].position;
+        notification.events[i].age = sys_cpu_to_le16(events[i].age);
+    }
+
+    received_count = 0;
+    return zmk_split_position_events_receive(
+        &receiver, position_state, (const uint8_t *)&notification,
+        offsetof(struct zmk_split_position_events, events) + count * sizeof(events[0]), now,
+        position_changed, &receiver);
+}
+
+static void setup(void) {
+    zmk_split_position_events_reset(&receiver);
+    memset(position_state, 0, sizeof(position_state));
+    received_count = 0;
+}
+
+static void teardown(void) {}
+
+static uint32_t peripheral_time(const struct clock_offset_scenario *scenario, int64_t time_us) {
+    int64_t elapsed_us = time_us + time_us * scenario->drift_ppm / 1000000;
+    return scenario->peripheral_start_ms + (uint32_t)(elapsed_us / 1000);
+}
+
+static void add_timing_error(struct timing_error *error, int64_t timestamp, int64_t time_us) {
+    int64_t error_us = timestamp * 1000 - time_us;
+    error_us = error_us < 0 ? -error_us : error_us;
+    error->total_us += error_us;
+    error->max_us = MAX(error->max_us, error_us);
+}
+
+static void run_scenario(const struct clock_offset_scenario *scenario) {
+    int64_t time_us = 0;
+    uint8_t seq = 0;
+    struct timing_error offset_error = {0};
+    // stamping events with the receipt time minus their age, as before the peripheral timestamps
+    struct timing_error age_error = {0};
+
+    random_state = 0x2545F491;
+    zmk_split_position_events_synced(&receiver, seq);
+
+    for (int i = 0; i < SIMULATED_EVENTS; i++) {
+        time_us += 20000 + next_random(230000);
+        if (scenario->idle_ms > 0 && i == scenario->idle_after) {
+            time_us += (int64_t)scenario->idle_ms * 1000;
+        }
+
+        // the event is sent at the next connection event, and may take a few to get through
+        int64_t sent_us = ROUND_UP(time_us, CONNECTION_INTERVAL_US);
+        int64_t received_us = sent_us + TRANSPORT_DELAY_US + next_random(CONNECTION_INTERVAL_US);
+        if (next_random(100) < scenario->retry_percent) {
+            received_us += (1 + next_random(2)) * CONNECTION_INTERVAL_US;
+        }
+
+        uint8_t position = i % 8;
+        bool pressed = !(position_state[0] & BIT(position));
+        uint32_t sent_at = peripheral_time(scenario, sent_us);
+        struct zmk_split_position_event event = {
+            .position = position | (pressed ? ZMK_SPLIT_POSITION_EVENT_PRESSED : 0),
+            .age = sent_at - peripheral_time(scenario, time_us),
+        };
+        int64_t received_at = received_us / 1000;
+
+        zassert_equal(receive(seq++, sent_at, &event, 1, received_at), 0, "event %d rejected", i);
+        zassert_equal(received_count, 1, "event %d not raised", i);
+        zassert_equal(received[0].position, position, "wrong position for event %d", i);
+        zassert_equal(received[0].pressed, pressed, "wrong state for event %d", i);
+        zassert_true(received[0].timestamp <= received_at, "event %d timed after receipt", i);
+
+        add_timing_error(&offset_error, received[0].timestamp, time_us);
+        add_timing_error(&age_error, received_at - event.age, time_us);
+    }
+
+    int64_t offset_average_us = offset_error.total_us / SIMULATED_EVENTS;
+    int64_t age_average_us = age_error.total_us / SIMULATED_EVENTS;
+    zassert_true(offset_average_us < MAX_AVERAGE_ERROR_US, "average error %d us",
+                 (int)offset_average_us);
+    zassert_true(offset_average_us < age_average_us,
+                 "average error %d us, %d us when stamped with the age", (int)offset_average_us,
+                 (int)age_average_us);
+    zassert_true(offset_error.max_us < age_error.max_us,
+                 "max error %d us, %d us when stamped with the age", (int)offset_error.max_us,
+                 (int)age_error.max_us);
+}
+
+static void test_no_drift(void) {
+    struct clock_offset_scenario scenario = {.peripheral_start_ms = 5000, .retry_percent = 5};
+    run_scenario(&scenario);
+}
+
+static void test_fast_peripheral(void) {
+    struct clock_offset_scenario scenario = {
+        .peripheral_start_ms = 250, .drift_ppm = 60, .retry_percent = 5};
+    run_scenario(&scenario);
+}
+
+static void test_slow_peripheral_after_idle(void) {
+    struct clock_offset_scenario scenario = {.peripheral_start_ms = 90000,
+                                             .drift_ppm = -60,
+                                             .retry_percent = 5,
+                                             .idle_after = 1000,
+                                             .idle_ms = 600000};
+    run_scenario(&scenario);
+}
+
+static void test_wrapping_peripheral_clock(void) {
+    struct clock_offset_scenario scenario = {
+        .peripheral_start_ms = UINT32_MAX - 30000, .drift_ppm = 40, .retry_percent = 20};
+    run_scenario(&scenario);
+}
+
+static void test_unsynced_asks_for_sync(void) {
+    struct zmk_split_position_event event = {.position = 3 | ZMK_SPLIT_POSITION_EVENT_PRESSED};
+
+    zassert_equal(receive(0, 1000, &event, 1, 1000), -EAGAIN, "accepted before the sync");
+    zassert_equal(received_count, 0, "raised before the sync");
+    zassert_equal(position_state[0], 0, "changed state before the sync");
+}
+
+static void test_lost_notification_asks_for_sync(void) {
+    struct zmk_split_position_event event = {.position = 3 | ZMK_SPLIT_POSITION_EVENT_PRESSED};
+
+    zmk_split_position_events_synced(&receiver, 10);
+    zassert_equal(receive(11, 1000, &event, 1, 1000), -EAGAIN, "accepted after a gap");
+    zassert_equal(received_count, 0, "raised after a gap");
+    zassert_false(receiver.synced, "still synced after a gap");
+    zassert_equal(receive(10, 1000, &event, 1, 1000), -EAGAIN, "accepted before the resync");
+}
+
+static void test_notification_before_sync_is_skipped(void) {
+    struct zmk_split_position_event event = {.position = 3 | ZMK_SPLIT_POSITION_EVENT_PRESSED};
+
+    // the sequence number wraps
+    zmk_split_position_events_synced(&receiver, 1);
+    zassert_equal(receive(255, 1000, &event, 1, 1000), 0, "rejected a notification before sync");
+    zassert_equal(received_count, 0, "raised a change already in the sync");
+    zassert_equal(receiver.next_seq, 1, "moved on with a notification before the sync");
+}
+
+static void test_events_in_sync_are_skipped(void) {
+    struct zmk_split_position_event events[] = {
+        {.position = 3 | ZMK_SPLIT_POSITION_EVENT_PRESSED, .age = 30},
+        {.position = 9 | ZMK_SPLIT_POSITION_EVENT_PRESSED, .age = 20},
+        {.position = 3, .age = 10},
+    };
+
+    // the sync already had the first press
+    position_state[0] = BIT(3);
+    zmk_split_position_events_synced(&receiver, 0);
+    zassert_equal(receive(0, 1000, events, ARRAY_SIZE(events), 5000), 0, "rejected");
+    zassert_equal(received_count, 2, "expected the second and third events");
+    zassert_equal(received[0].position, 9, "wrong first position");
+    zassert_true(received[0].pressed, "wrong first state");
+    zassert_equal(received[1].position, 3, "wrong second position");
+    zassert_false(received[1].pressed, "wrong second state");
+    zassert_true(received[0].timestamp < received[1].timestamp, "events out of order");
+    zassert_equal(position_state[0], 0, "wrong state of the first byte");
+    zassert_equal(position_state[1], BIT(1), "wrong state of the second byte");
+    zassert_equal(receiver.next_seq, 1, "didn't move on to the next notification");
+}
+
+static void test_invalid_length(void) {
+    uint8_t data[sizeof(struct zmk_split_position_events)] = {0};
+    size_t header_len = offsetof(struct zmk_split_position_events, events);
+
+    zmk_split_position_events_synced(&receiver, 0);
+    zassert_equal(zmk_split_position_events_receive(&receiver, position_state, data,
+                                                    header_len - 1, 0, position_changed,
+                                                    &receiver),
+                  -EINVAL, "accepted a truncated header");
+    zassert_equal(zmk_split_position_events_receive(&receiver, position_state, data,
+                                                    header_len + 1, 0, position_changed,
+                                                    &receiver),
+                  -EINVAL, "accepted a truncated event");
+    zassert_equal(receiver.next_seq, 0, "moved on with an invalid notification");
+}
+
+void test_main(void) {
+    ztest_test_suite(split_position_events,
+                     ztest_unit_test_setup_teardown(test_no_drift, setup, teardown),
+                     ztest_unit_test_setup_teardown(test_fast_peripheral, setup, teardown),
+                     ztest_unit_test_setup_teardown(test_slow_peripheral_after_idle, setup,
+                                                    teardown),
+                     ztest_unit_test_setup_teardown(test_wrapping_peripheral_clock, setup,
+                                                    teardown),
+                     ztest_unit_test_setup_teardown(test_unsynced_asks_for_sync, setup, teardown),
+                     ztest_unit_test_setup_teardown(test_lost_notification_asks_for_sync, setup,
+                                                    teardown),
+                     ztest_unit_test_setup_teardown(test_notification_before_sync_is_skipped,
+                                                    setup, teardown),
+                     ztest_unit_test_setup_teardown(test_events_in_sync_are_skipped, setup,
+                                                    teardown),
+                     ztest_unit_test_setup_teardown(test_invalid_length, setup, teardown));
+    ztest_run_test_suite(split_position_events);
+}